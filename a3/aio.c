@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "aio.h"
+
+/* Asynchronous I/O for overlapping reads and writes with sorting and
+ * merging. Setting PSORT_AIO=thread skips io_uring.
+ */
+
+/* Return 1 if ring runs IORING_OP_READ and IORING_OP_WRITE. Kernels 5.1
+ * to 5.5 have io_uring without them, and without the probe too.
+ */
+static int uring_can_rw(int ring) {
+    size_t len = sizeof(struct io_uring_probe) +
+                 (IORING_OP_WRITE + 1) * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int ok = syscall(__NR_io_uring_register, ring, IORING_REGISTER_PROBE, probe,
+                     IORING_OP_WRITE + 1) == 0 &&
+             probe->last_op >= IORING_OP_WRITE &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+static int uring_setup(struct aio *aio) {
+    char *env = getenv("PSORT_AIO");
+    if (env != NULL && strcmp(env, "thread") == 0) {
+        return -1;
+    }
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int ring = syscall(__NR_io_uring_setup, AIO_SLOTS, &p);
+    if (ring == -1) {
+        return -1;
+    }
+    if (!uring_can_rw(ring)) {
+        close(ring);
+        return -1;
+    }
+    aio->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aio->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    aio->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sq_map = mmap(NULL, aio->sq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    aio->cq_map = mmap(NULL, aio->cq_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (aio->sq_map == MAP_FAILED || aio->cq_map == MAP_FAILED ||
+        aio->sqes == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    char *sq = aio->sq_map, *cq = aio->cq_map;
+    aio->sq_head = (unsigned *) (sq + p.sq_off.head);
+    aio->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    aio->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    aio->sq_array = (unsigned *) (sq + p.sq_off.array);
+    aio->cq_head = (unsigned *) (cq + p.cq_off.head);
+    aio->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    aio->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    aio->cqes = cq + p.cq_off.cqes;
+    aio->ring = ring;
+    return 0;
+}
+
+/* Run op to completion, however many calls it takes. */
+static ssize_t run_op(struct aio_op *op, size_t done) {
+    while (done < op->len) {
+        ssize_t n = op->write ? pwrite(op->fd, op->buf + done, op->len - done,
+                                       op->offset + done)
+                              : pread(op->fd, op->buf + done, op->len - done,
+                                      op->offset + done);
+        if (n == -1) {
+            perror(op->write ? "pwrite" : "pread");
+            exit(1);
+        }
+        if (n == 0) {
+            break;  // end of file
+        }
+        done += n;
+    }
+    return done;
+}
+
+static void *io_thread(void *arg) {
+    struct aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    while (1) {
+        while (aio->head == aio->tail && !aio->stop) {
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        }
+        if (aio->head == aio->tail) {
+            break;
+        }
+        struct aio_op *op = &aio->ops[aio->queue[aio->head % AIO_SLOTS]];
+        pthread_mutex_unlock(&aio->lock);
+        ssize_t res = run_op(op, 0);
+        pthread_mutex_lock(&aio->lock);
+        op->res = res;
+        op->done = 1;
+        aio->head++;
+        pthread_cond_broadcast(&aio->cond);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+void aio_open(struct aio *aio) {
+    memset(aio, 0, sizeof(*aio));
+    if (uring_setup(aio) == 0) {
+        return;
+    }
+    aio->ring = -1;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->cond, NULL);
+    int err = pthread_create(&aio->thread, NULL, io_thread, aio);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: error %d\n", err);
+        exit(1);
+    }
+}
+
+const char *aio_engine(struct aio *aio) {
+    return aio->ring == -1 ? "thread" : "io_uring";
+}
+
+/* Start reading (or writing, if write is set) len bytes at offset of fd
+ * into (from) buf, in slot, which must not be busy. Wait for it with
+ * aio_wait() before touching buf again.
+ */
+void aio_submit(struct aio *aio, int slot, int write, int fd, void *buf,
+                size_t len, off_t offset) {
+    struct aio_op *op = &aio->ops[slot];
+    op->write = write;
+    op->fd = fd;
+    op->buf = buf;
+    op->len = len;
+    op->offset = offset;
+    op->busy = 1;
+    op->done = 0;
+    if (aio->ring == -1) {
+        pthread_mutex_lock(&aio->lock);
+        aio->queue[aio->tail++ % AIO_SLOTS] = slot;
+        pthread_cond_broadcast(&aio->cond);
+        pthread_mutex_unlock(&aio->lock);
+        return;
+    }
+    unsigned tail = *aio->sq_tail;
+    unsigned idx = tail & *aio->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *) aio->sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    aio->sq_array[idx] = idx;
+    __atomic_store_n(aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, aio->ring, 1, 0, 0, NULL, 0) == -1) {
+        perror("io_uring_enter");
+        exit(1);
+    }
+}
+
+/* Wait for the operation in slot and return how many bytes it moved:
+ * all of them, or fewer only if a read reached the end of the file.
+ */
+ssize_t aio_wait(struct aio *aio, int slot) {
+    struct aio_op *op = &aio->ops[slot];
+    if (aio->ring == -1) {
+        pthread_mutex_lock(&aio->lock);
+        while (!op->done) {
+            pthread_cond_wait(&aio->cond, &aio->lock);
+        }
+        pthread_mutex_unlock(&aio->lock);
+    }
+    while (!op->done) {
+        unsigned head = *aio->cq_head;
+        if (head == __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, aio->ring, 0, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0) == -1) {
+                perror("io_uring_enter");
+                exit(1);
+            }
+            continue;
+        }
+        struct io_uring_cqe *cqe = (struct io_uring_cqe *) aio->cqes +
+                                   (head & *aio->cq_mask);
+        struct aio_op *o = &aio->ops[cqe->user_data];
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            perror(o->write ? "io_uring write" : "io_uring read");
+            exit(1);
+        }
+        // a short transfer that is not the end of the file is finished
+        // synchronously
+        o->res = cqe->res > 0 ? run_op(o, cqe->res) : 0;
+        o->done = 1;
+        __atomic_store_n(aio->cq_head, head + 1, __ATOMIC_RELEASE);
+    }
+    op->busy = 0;
+    return op->res;
+}
+
+/* Wait for everything still in flight and release the queue. */
+void aio_close(struct aio *aio) {
+    for (int slot = 0; slot < AIO_SLOTS; slot++) {
+        if (aio->ops[slot].busy) {
+            aio_wait(aio, slot);
+        }
+    }
+    if (aio->ring != -1) {
+        munmap(aio->sqes, aio->sqes_len);
+        munmap(aio->cq_map, aio->cq_len);
+        munmap(aio->sq_map, aio->sq_len);
+        close(aio->ring);
+        return;
+    }
+    pthread_mutex_lock(&aio->lock);
+    aio->stop = 1;
+    pthread_cond_broadcast(&aio->cond);
+    pthread_mutex_unlock(&aio->lock);
+    pthread_join(aio->thread, NULL);
+    pthread_cond_destroy(&aio->cond);
+    pthread_mutex_destroy(&aio->lock);
+}
+
+/* Write to fd, from its current offset, through two buffers of size
+ * bytes each. A pipe or FIFO has no offset to write at, so it gets plain
+ * write()s in order instead, one buffer at a time.
+ */
+void writer_open(struct writer *w, int fd, size_t size) {
+    w->fd = fd;
+    if ((w->offset = lseek(fd, 0, SEEK_CUR)) == -1 && errno != ESPIPE) {
+        perror("lseek");
+        exit(1);
+    }
+    w->pipe = w->offset == -1;
+    if (!w->pipe) {
+        aio_open(&w->aio);
+    }
+    w->size = size;
+    w->len = 0;
+    w->cur = 0;
+    w->buf[0] = malloc(size);
+    w->buf[1] = malloc(size);
+    if (w->buf[0] == NULL || w->buf[1] == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+}
+
+/* Start writing the current buffer and switch to the other one, once
+ * its own write is done.
+ */
+static void writer_flush(struct writer *w) {
+    if (w->len == 0) {
+        return;
+    }
+    if (w->pipe) {
+        for (size_t done = 0; done < w->len; ) {
+            ssize_t n = write(w->fd, w->buf[w->cur] + done, w->len - done);
+            if (n == -1) {
+                perror("write");
+                exit(1);
+            }
+            done += n;
+        }
+        w->len = 0;
+        return;
+    }
+    aio_submit(&w->aio, w->cur, 1, w->fd, w->buf[w->cur], w->len, w->offset);
+    w->offset += w->len;
+    w->cur = !w->cur;
+    w->len = 0;
+    if (w->aio.ops[w->cur].busy) {
+        aio_wait(&w->aio, w->cur);
+    }
+}
+
+void writer_put(struct writer *w, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        size_t n = w->size - w->len < len ? w->size - w->len : len;
+        memcpy(w->buf[w->cur] + w->len, p, n);
+        w->len += n;
+        p += n;
+        len -= n;
+        if (w->len == w->size) {
+            writer_flush(w);
+        }
+    }
+}
+
+/* Write out what is left and wait for it. The fd stays open, positioned
+ * after the data.
+ */
+void writer_close(struct writer *w) {
+    writer_flush(w);
+    if (w->pipe) {
+        free(w->buf[1]);
+        free(w->buf[0]);
+        return;
+    }
+    aio_close(&w->aio);
+    if (lseek(w->fd, w->offset, SEEK_SET) == -1) {
+        perror("lseek");
+        exit(1);
+    }
+    free(w->buf[1]);
+    free(w->buf[0]);
+}
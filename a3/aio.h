@@ -0,0 +1,67 @@
+#ifndef _AIO_H
+#define _AIO_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+/* At most this many reads and writes are in flight on one queue. */
+#define AIO_SLOTS 4
+
+struct aio_op {
+    int write;
+    int fd;
+    char *buf;
+    size_t len;
+    off_t offset;
+    ssize_t res;
+    int busy;               // submitted and not yet waited for
+    int done;               // complete, res is set
+};
+
+/* A queue of asynchronous preads and pwrites, each in a numbered slot.
+ * It runs on io_uring where the kernel allows it, and on an I/O thread
+ * that performs the operations in submission order otherwise.
+ */
+struct aio {
+    struct aio_op ops[AIO_SLOTS];
+    int ring;               // the io_uring fd, or -1 for the I/O thread
+    // io_uring: the mapped rings
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *sqes, *cqes;
+    // the I/O thread, working through queue[head, tail)
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int queue[AIO_SLOTS];
+    long head, tail;
+    int stop;
+};
+
+void aio_open(struct aio *aio);
+void aio_submit(struct aio *aio, int slot, int write, int fd, void *buf,
+                size_t len, off_t offset);
+ssize_t aio_wait(struct aio *aio, int slot);
+void aio_close(struct aio *aio);
+const char *aio_engine(struct aio *aio);
+
+/* Write-behind output: records are copied into one buffer while the
+ * other is being written.
+ */
+struct writer {
+    struct aio aio;
+    int fd;
+    off_t offset;
+    int pipe;               // fd cannot seek: write in order, without aio
+    char *buf[2];
+    size_t len;             // bytes in buf[cur]
+    size_t size;
+    int cur;
+};
+
+void writer_open(struct writer *w, int fd, size_t size);
+void writer_put(struct writer *w, const void *data, size_t len);
+void writer_close(struct writer *w);
+#endif /* _AIO_H */
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Sweep psort across worker counts and backends on generated data sets
+# and print a throughput table.
+#
+#   ./bench.sh [records]
+#
+# The environment can override what is swept:
+#   WORDS    word list for mkwords (default ../a4/dictionary.txt)
+#   DISTS    mkwords distributions (default: all of them)
+#   WORKERS  values of -n (default: 1 2 4 8 16)
+#   MODES    psort backends, comma separated flags (default: every one)
+#   SEED     mkwords seed, so runs can be compared (default 1)
+#   GEN      mkwords threads; with the seed it fixes the data (default 4)
+#   BUDGET   memory budget for the external sort mode (default 64M)
+#   DIR      where the data sets go (default $TMPDIR or /tmp)
+
+RECORDS=${1:-1000000}
+WORDS=${WORDS:-../a4/dictionary.txt}
+DISTS=${DISTS:-"uniform zipf sorted reverse dups wide"}
+WORKERS=${WORKERS:-"1 2 4 8 16"}
+BUDGET=${BUDGET:-64M}
+MODES=${MODES:-"pipes shared:-z threads:-t sample:-S external:-m,$BUDGET index:-t,-i"}
+SEED=${SEED:-1}
+GEN=${GEN:-4}
+DIR=${DIR:-${TMPDIR:-/tmp}}
+
+if [ ! -f "$WORDS" ]; then
+    WORDS=8-words.txt
+fi
+in="$DIR/psort-bench.$$.b"
+out="$DIR/psort-bench.$$.out"
+trap 'rm -f "$in" "$out"' EXIT INT TERM
+
+mb=$(echo "$RECORDS" | awk '{ printf "%.1f", $1 * 48 / 1e6 }')
+echo "# $RECORDS records ($mb MB), seed $SEED on $GEN threads, words from $WORDS"
+printf "%-8s %-9s %4s %12s %10s\n" dist mode n "wall ms" "MB/s"
+for dist in $DISTS; do
+    ./mkwords -f "$WORDS" -o "$in" -c "$RECORDS" -s "$SEED" -t "$GEN" \
+        -d "$dist" || exit 1
+    for mode in $MODES; do
+        name=${mode%%:*}
+        flags=$(echo "${mode#$name}" | sed 's/^://; s/,/ /g')
+        for n in $WORKERS; do
+            wall=$(./psort -n "$n" $flags -f "$in" -o "$out" --stats=json |
+                   sed -n '1s/.*"wall_ms": \([0-9.]*\).*/\1/p')
+            if [ -z "$wall" ]; then
+                echo "psort -n $n $flags failed on $dist data" >&2
+                exit 1
+            fi
+            printf "%-8s %-9s %4s %12s %10s\n" "$dist" "$name" "$n" "$wall" \
+                $(echo "$mb $wall" | awk '{ printf "%.1f", $1 / ($2 / 1e3) }')
+        done
+    done
+done
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "pool.h"
+#include "stats.h"
+#include "compact.h"
+
+/* Sorting a v2 file moves only its 8-byte entries: the words stay in
+ * the pool, which is copied to the output unchanged. A pool of threads
+ * sorts one slice of the entries each as (key, word offset) pairs with
+ * the usual key engines, then merges the slices pairwise. A pair holds
+ * the entry's position rather than its word offset, so records with equal
+ * keys keep their input order whatever order the pool is in.
+ */
+
+struct compact_sort {
+    struct v2_rec *entries;
+    char *pool;
+    long count;
+    long n_slices;
+    struct key_idx *src, *dst;      // the pairs, and scratch for merging
+    long width;                     // slices per run in this merge round
+    struct psort_opts *opts;
+};
+
+/* Read filename's v2 header into *hdr. Return 0 if it has a valid one
+ * and its size matches it, -1 otherwise.
+ */
+static int read_header(char *filename, struct v2_header *hdr) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    ssize_t n = read(fd, hdr, sizeof(*hdr));
+    close(fd);
+    if (n != sizeof(*hdr) || memcmp(hdr->magic, V2_MAGIC, 4) != 0 ||
+        hdr->version != V2_VERSION || hdr->count < 0 || hdr->pool_size < 0) {
+        return -1;
+    }
+    off_t size = sizeof(*hdr) + hdr->count * sizeof(struct v2_rec) + hdr->pool_size;
+    return get_file_size(filename) == size ? 0 : -1;
+}
+
+/* Return the number of records in filename if it is a v2 file, or -1 if
+ * it is in the original 48-byte format.
+ */
+long compact_count(char *filename) {
+    struct v2_header hdr;
+    return read_header(filename, &hdr) == 0 ? hdr.count : -1;
+}
+
+/* Return the word of the entry a pair stands for. */
+static const char *pair_word(struct compact_sort *cs, struct key_idx *p) {
+    return cs->pool + cs->entries[p->idx].word;
+}
+
+/* Compare two pairs by the keys of the order from key from on. The pairs
+ * hold rec_key() of the record, so a leading freq key is a plain int
+ * compare.
+ */
+static int pair_cmp(struct compact_sort *cs, int from, struct key_idx *a,
+                    struct key_idx *b) {
+    const struct order *order = &cs->opts->order;
+    for (int k = from; k < 2; k++) {
+        int fa = order->desc ? ~a->freq : a->freq;
+        int fb = order->desc ? ~b->freq : b->freq;
+        int c;
+        switch (order->keys[k]) {
+        case KEY_FREQ_ASC:
+            c = (fa > fb) - (fa < fb);
+            break;
+        case KEY_FREQ_DESC:
+            c = (fb > fa) - (fb < fa);
+            break;
+        case KEY_WORD_ASC:
+            c = strcmp(pair_word(cs, a), pair_word(cs, b));
+            break;
+        case KEY_WORD_DESC:
+            c = strcmp(pair_word(cs, b), pair_word(cs, a));
+            break;
+        default:
+            return 0;
+        }
+        if (c != 0) {
+            return c;
+        }
+    }
+    return 0;
+}
+
+/* Stably merge src[lo, mid) and src[mid, hi) into dst by the order's
+ * keys from key from on.
+ */
+static void merge_pairs(struct compact_sort *cs, int from, struct key_idx *src,
+                        struct key_idx *dst, long lo, long mid, long hi) {
+    long i = lo, j = mid, k = lo;
+    while (i < mid && j < hi) {
+        dst[k++] = pair_cmp(cs, from, &src[j], &src[i]) < 0 ? src[j++] : src[i++];
+    }
+    while (i < mid) {
+        dst[k++] = src[i++];
+    }
+    while (j < hi) {
+        dst[k++] = src[j++];
+    }
+}
+
+/* Stable bottom-up merge sort of pairs [lo, hi) by the keys from from on,
+ * using tmp as scratch.
+ */
+static void sort_pairs(struct compact_sort *cs, int from, struct key_idx *pairs,
+                       struct key_idx *tmp, long lo, long hi) {
+    struct key_idx *src = pairs, *dst = tmp;
+    for (long width = 1; width < hi - lo; width *= 2) {
+        for (long l = lo; l < hi; l += 2 * width) {
+            long mid = l + width < hi ? l + width : hi;
+            long h = l + 2 * width < hi ? l + 2 * width : hi;
+            merge_pairs(cs, from, src, dst, l, mid, h);
+        }
+        struct key_idx *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != pairs) {
+        memcpy(pairs + lo, src + lo, (hi - lo) * sizeof(struct key_idx));
+    }
+}
+
+static void sort_task(long t, void *arg) {
+    struct compact_sort *cs = arg;
+    const struct order *order = &cs->opts->order;
+    struct timespec wall, cpu, wall_end, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    long lo = part_start(t, cs->count, cs->n_slices);
+    long n = part_size(t, cs->count, cs->n_slices);
+    struct key_idx *pairs = cs->src + lo;
+    for (long i = 0; i < n; i++) {
+        pairs[i].freq = order->desc ? ~cs->entries[lo + i].freq
+                                    : cs->entries[lo + i].freq;
+        pairs[i].idx = lo + i;
+    }
+    enum sort_algo used = SORT_MERGE;
+    if (!order->by_freq) {
+        sort_pairs(cs, 0, cs->src, cs->dst, lo, lo + n);
+    } else {
+        if (sort_keys(pairs, n, cs->opts->algo, &used) == -1) {
+            exit(1);
+        }
+        // then each run of equal keys by the word
+        for (long i = 0, j; order->keys[1] != KEY_NONE && i < n; i = j) {
+            for (j = i + 1; j < n && pairs[j].freq == pairs[i].freq; j++)
+                ;
+            if (j - i > 1) {
+                sort_pairs(cs, 1, cs->src, cs->dst, lo + i, lo + j);
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    double wall_ms = (wall_end.tv_sec - wall.tv_sec) * 1e3 +
+                     (wall_end.tv_nsec - wall.tv_nsec) / 1e6;
+    stats_task(t, n, algo_name(used), 1, wall_ms,
+               (cpu_end.tv_sec - cpu.tv_sec) * 1e3 +
+               (cpu_end.tv_nsec - cpu.tv_nsec) / 1e6);
+    if (cs->opts->verbose) {
+        fprintf(stderr, "worker %ld: %ld records, %s sort of v2 entries, %.3f ms\n",
+                t, n, algo_name(used), wall_ms);
+    }
+}
+
+/* Merge runs 2t and 2t + 1 of the current round, each width slices. A
+ * last run with no partner is copied across.
+ */
+static void merge_task(long t, void *arg) {
+    struct compact_sort *cs = arg;
+    long first = 2 * t * cs->width;
+    long mid = first + cs->width < cs->n_slices ? first + cs->width : cs->n_slices;
+    long last = mid + cs->width < cs->n_slices ? mid + cs->width : cs->n_slices;
+    merge_pairs(cs, 0, cs->src, cs->dst, part_start(first, cs->count, cs->n_slices),
+                part_start(mid, cs->count, cs->n_slices),
+                part_start(last, cs->count, cs->n_slices));
+}
+
+void sort_compact(char *input_file, char *output_file, int n_threads,
+                  struct psort_opts *opts) {
+    struct v2_header hdr;
+    if (read_header(input_file, &hdr) == -1) {
+        fprintf(stderr, "psort: %s is not a valid v2 file\n", input_file);
+        exit(1);
+    }
+    // the word pool is copied out of the mapped input, so a file sorted
+    // onto itself goes through a temporary output
+    char *name = output_name(input_file, output_file);
+    FILE *ofp = fopen(name, "w");
+    if (ofp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    stats_phase(PHASE_READ);
+    size_t len = get_file_size(input_file);
+    int fd = open(input_file, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    struct compact_sort cs;
+    cs.entries = (struct v2_rec *) (base + sizeof(hdr));
+    cs.pool = (char *) (cs.entries + hdr.count);
+    cs.count = hdr.count;
+    cs.opts = opts;
+    if (hdr.pool_size > 0 && cs.pool[hdr.pool_size - 1] != '\0') {
+        fprintf(stderr, "psort: %s has an unterminated word pool\n", input_file);
+        exit(1);
+    }
+    for (long i = 0; i < hdr.count; i++) {
+        if (cs.entries[i].word >= hdr.pool_size) {
+            fprintf(stderr, "psort: %s has a word outside its pool\n", input_file);
+            exit(1);
+        }
+    }
+    cs.n_slices = n_threads < hdr.count ? n_threads : (hdr.count > 0 ? hdr.count : 1);
+    cs.src = malloc(hdr.count * sizeof(struct key_idx));
+    cs.dst = malloc(hdr.count * sizeof(struct key_idx));
+    struct v2_rec *out = malloc(hdr.count * sizeof(struct v2_rec));
+    if ((cs.src == NULL || cs.dst == NULL || out == NULL) && hdr.count > 0) {
+        perror("malloc");
+        exit(1);
+    }
+
+    stats_tasks(cs.n_slices);
+    stats_phase(PHASE_SORT);
+    pool_run(n_threads, cs.n_slices, sort_task, &cs);
+    // each round halves the number of sorted runs
+    stats_phase(PHASE_MERGE);
+    for (cs.width = 1; cs.width < cs.n_slices; cs.width *= 2) {
+        long n_merges = (cs.n_slices + 2 * cs.width - 1) / (2 * cs.width);
+        pool_run(n_threads, n_merges, merge_task, &cs);
+        struct key_idx *t = cs.src;
+        cs.src = cs.dst;
+        cs.dst = t;
+    }
+
+    stats_phase(PHASE_WRITE);
+    for (long i = 0; i < hdr.count; i++) {
+        out[i].freq = opts->order.desc ? ~cs.src[i].freq : cs.src[i].freq;
+        out[i].word = cs.entries[cs.src[i].idx].word;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, ofp) != 1 ||
+        fwrite(out, sizeof(struct v2_rec), hdr.count, ofp) != hdr.count ||
+        fwrite(cs.pool, 1, hdr.pool_size, ofp) != hdr.pool_size) {
+        perror("fwrite");
+        exit(1);
+    }
+    if (fclose(ofp) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+    finish_output(name, output_file);
+    free(out);
+    free(cs.dst);
+    free(cs.src);
+    munmap(base, len);
+}
@@ -0,0 +1,29 @@
+#ifndef _COMPACT_H
+#define _COMPACT_H
+
+#include "helper.h"
+
+/* The v2 record file. A header is followed by count fixed-width entries,
+ * then by a pool of the words they point into, each ending in a NUL.
+ * The pool's layout is free: psort sorts the entries alone and copies the
+ * pool unchanged, and keeps records with equal keys in entry order.
+ */
+#define V2_MAGIC "PSR2"
+#define V2_VERSION 2
+
+struct v2_header {
+    char magic[4];
+    unsigned int version;
+    long count;             // entries
+    long pool_size;         // bytes of words, NULs included
+};
+
+struct v2_rec {
+    int freq;
+    unsigned int word;      // offset of the word in the pool
+};
+
+long compact_count(char *filename);
+void sort_compact(char *input_file, char *output_file, int n_threads,
+                  struct psort_opts *opts);
+#endif /* _COMPACT_H */
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include "cpu.h"
+
+/* Worker sizing and placement.
+ * With -P every worker is pinned to one CPU. The CPUs are handed out node
+ * by node, so neighbouring workers, whose slices are merged together,
+ * share a NUMA node. Nothing is bound explicitly: the kernel places a page
+ * on the node of the CPU that first touches it, and every backend has its
+ * workers fill their own buffers, so a pinned worker's memory is local.
+ */
+
+/* The CPUs workers are pinned to, in order, or NULL when not pinning. */
+static int *pin_cpus;
+static int n_pin;
+/* The CPUs the process could run on before any worker was pinned. */
+static cpu_set_t pin_allowed;
+
+/* Return the number of CPUs this process may run on. */
+int online_cpus(void) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        return CPU_COUNT(&set);
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* Return the worker count for -n auto: one per CPU, but no more than
+ * gives each MIN_WORKER_RECS records of size. A size of -1 is unknown,
+ * as for streamed input.
+ */
+int auto_workers(long size) {
+    int n = online_cpus();
+    if (size >= 0 && size / MIN_WORKER_RECS < n) {
+        n = size / MIN_WORKER_RECS;
+    }
+    return n > 0 ? n : 1;
+}
+
+/* Append the CPUs of cpulist, e.g. "0-3,8-11", that are in allowed and
+ * not yet taken to pin_cpus.
+ */
+static void add_cpus(char *cpulist, cpu_set_t *allowed, cpu_set_t *taken) {
+    char *p = cpulist;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p) {
+            return;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+        }
+        for (long cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, allowed) && !CPU_ISSET(cpu, taken)) {
+                CPU_SET(cpu, taken);
+                pin_cpus[n_pin++] = cpu;
+            }
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+}
+
+/* Pin the workers started from now on. The CPUs are those this process
+ * may run on, ordered by NUMA node when sysfs describes the nodes.
+ */
+void pin_init(void) {
+    cpu_set_t allowed, taken;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        perror("sched_getaffinity");
+        exit(1);
+    }
+    pin_allowed = allowed;
+    CPU_ZERO(&taken);
+    pin_cpus = malloc(CPU_COUNT(&allowed) * sizeof(int));
+    if (pin_cpus == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    n_pin = 0;
+    char name[64], cpulist[4096];
+    for (int node = 0; ; node++) {
+        snprintf(name, sizeof(name), "/sys/devices/system/node/node%d/cpulist",
+                 node);
+        FILE *fp = fopen(name, "r");
+        if (fp == NULL) {
+            break;
+        }
+        if (fgets(cpulist, sizeof(cpulist), fp) != NULL) {
+            add_cpus(cpulist, &allowed, &taken);
+        }
+        fclose(fp);
+    }
+    // CPUs sysfs left out, or all of them without NUMA support
+    for (int cpu = 0; cpu < CPU_SETSIZE && n_pin < CPU_COUNT(&allowed); cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && !CPU_ISSET(cpu, &taken)) {
+            CPU_SET(cpu, &taken);
+            pin_cpus[n_pin++] = cpu;
+        }
+    }
+}
+
+/* Pin the calling worker, a process or a thread, to its CPU. Workers
+ * beyond the number of CPUs wrap around. Does nothing without pin_init().
+ */
+void pin_worker(long id) {
+    if (pin_cpus == NULL) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pin_cpus[id % n_pin], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+}
+
+/* Let a thread that worked for a while, such as the one that called
+ * pool_run(), run on every CPU it could before pin_init() again.
+ */
+void unpin_worker(void) {
+    if (pin_cpus == NULL) {
+        return;
+    }
+    if (sched_setaffinity(0, sizeof(pin_allowed), &pin_allowed) == -1) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _CPU_H
+#define _CPU_H
+
+/* -n auto gives every worker at least this many records. */
+#define MIN_WORKER_RECS (1L << 16)
+
+int online_cpus(void);
+int auto_workers(long size);
+void pin_init(void);
+void pin_worker(long id);
+void unpin_worker(void);
+#endif /* _CPU_H */
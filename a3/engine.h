@@ -0,0 +1,10 @@
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+#include "helper.h"
+
+/* The in-memory thread engine behind libpsort, which psort -t runs too. */
+
+int sort_buffer(struct rec *recs, long n, struct rec *out, int n_threads,
+                struct psort_opts *opts);
+#endif /* _ENGINE_H */
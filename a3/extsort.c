@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include "helper.h"
+#include "extsort.h"
+#include "aio.h"
+#include "cpu.h"
+#include "stats.h"
+
+/* Out-of-core sort for inputs that do not fit in memory.
+ * Each worker sorts its slice of the input in chunks that fit in its share
+ * of the memory budget and spills every chunk to a temporary run file.
+ * The parent then merges the runs, at most fan_in at a time, until one
+ * pass can write the output file.
+ */
+
+/* Run files live in a directory only this user can enter, made by the
+ * parent before the workers fork, so they can find it too. It is empty
+ * string while there is none.
+ */
+static char run_dir[256];
+static pid_t owner;
+
+/* Fill name with the path of run r of merge pass pass. */
+static void run_name(char *name, size_t len, int pass, long r) {
+    snprintf(name, len, "%s/%d.%ld", run_dir, pass, r);
+}
+
+/* Remove the run directory and whatever runs are left in it. Registered
+ * with atexit(), so a parent that gives up does not leave runs behind;
+ * workers inherit it, but only the parent removes anything.
+ */
+static void remove_runs(void) {
+    if (getpid() != owner || run_dir[0] == '\0') {
+        return;
+    }
+    DIR *dir = opendir(run_dir);
+    if (dir != NULL) {
+        char name[512];
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                snprintf(name, sizeof(name), "%s/%s", run_dir, entry->d_name);
+                unlink(name);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(run_dir);
+    run_dir[0] = '\0';
+}
+
+/* Make the run directory under $TMPDIR, or /tmp. */
+static void make_run_dir(void) {
+    char *tmp = getenv("TMPDIR");
+    if (tmp == NULL || tmp[0] == '\0') {
+        tmp = "/tmp";
+    }
+    snprintf(run_dir, sizeof(run_dir), "%s/psort.XXXXXX", tmp);
+    if (mkdtemp(run_dir) == NULL) {
+        perror(run_dir);
+        exit(1);
+    }
+    atexit(remove_runs);
+}
+
+/* Create the file name for writing, and return its fd. The file must not
+ * exist yet, so nothing planted in its place is followed.
+ */
+static int create(char *name) {
+    int fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        perror(name);
+        exit(1);
+    }
+    return fd;
+}
+
+/* Sort records [first, first + count) of input_file into runs of at most
+ * chunk records each, writing them to pass 0 run files starting at run.
+ * The next chunk is read into a second buffer while one is sorted, and
+ * each run is written behind the sort.
+ */
+static void spill_runs(char *input_file, long first, long count,
+                       long chunk, long run, struct psort_opts *opts) {
+    int fd = open(input_file, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    struct rec *buf[2];
+    buf[0] = malloc(chunk * sizeof(struct rec));
+    buf[1] = malloc(chunk * sizeof(struct rec));
+    if (buf[0] == NULL || buf[1] == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    struct aio reads;
+    aio_open(&reads);
+    if (opts->verbose && run == 0) {
+        fprintf(stderr, "psort: run I/O through %s\n", aio_engine(&reads));
+    }
+    if (count > 0) {
+        long n = count < chunk ? count : chunk;
+        aio_submit(&reads, 0, 0, fd, buf[0], n * sizeof(struct rec),
+                   first * sizeof(struct rec));
+    }
+    char name[512];
+    for (long done = 0, b = 0; done < count; done += chunk, run++, b = !b) {
+        long n = count - done < chunk ? count - done : chunk;
+        if (aio_wait(&reads, b) != n * sizeof(struct rec)) {
+            fprintf(stderr, "psort: input file ended early\n");
+            exit(1);
+        }
+        long next = done + chunk;
+        if (next < count) {
+            long m = count - next < chunk ? count - next : chunk;
+            aio_submit(&reads, !b, 0, fd, buf[!b], m * sizeof(struct rec),
+                       (first + next) * sizeof(struct rec));
+        }
+        run_name(name, sizeof(name), 0, run);
+        int ofd = create(name);
+        struct writer out;
+        writer_open(&out, ofd, MERGE_BUF);
+        worker_sort_to_file(run, buf[b], n, &out, opts);
+        writer_close(&out);
+        if (close(ofd) == -1) {
+            perror("close");
+            exit(1);
+        }
+    }
+    aio_close(&reads);
+    free(buf[1]);
+    free(buf[0]);
+    close(fd);
+}
+
+/* Merge runs [first, first + k) of pass pass into out and delete them. */
+static void merge_files(int pass, long first, int k, struct writer *out,
+                        const struct order *order) {
+    FILE *in[k];
+    struct rec head[k];
+    int idx[k];
+    int live = 0;
+    char name[512];
+    for (int i = 0; i < k; i++) {
+        run_name(name, sizeof(name), pass, first + i);
+        if ((in[i] = fopen(name, "r")) == NULL) {
+            perror(name);
+            exit(1);
+        }
+        // the file is gone as soon as the merge closes it
+        unlink(name);
+        setvbuf(in[i], NULL, _IOFBF, MERGE_BUF);
+        if (fread(&head[i], sizeof(struct rec), 1, in[i]) == 1) {
+            idx[live++] = i;
+        }
+    }
+    struct merge_heap heap;
+    heap_init(&heap, head, idx, live, order);
+    while (heap.live > 0) {
+        int top = heap_top(&heap);
+        writer_put(out, &head[top], sizeof(struct rec));
+        if (fread(&head[top], sizeof(struct rec), 1, in[top]) == 1) {
+            heap_advance(&heap);
+        } else {
+            heap_pop(&heap);
+        }
+    }
+    for (int i = 0; i < k; i++) {
+        if (ferror(in[i])) {
+            fprintf(stderr, "psort: error reading a temporary run\n");
+            exit(1);
+        }
+        fclose(in[i]);
+    }
+}
+
+/* Merge runs [first, first + k) of pass pass into fd and close it, with
+ * the output written behind the merge.
+ */
+static void merge_to(int fd, int pass, long first, int k,
+                     const struct order *order) {
+    struct writer out;
+    writer_open(&out, fd, MERGE_BUF);
+    merge_files(pass, first, k, &out, order);
+    writer_close(&out);
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+}
+
+void sort_external(char *input_file, char *output_file, long size,
+                   int n_process, size_t budget, struct psort_opts *opts) {
+    owner = getpid();
+    make_run_dir();
+    // every worker holds two chunks in memory, one being sorted and one
+    // being read, plus the scratch space its sort needs: a third copy of
+    // the chunk, or two key arrays
+    size_t rec_cost = opts->index ? 2 * sizeof(struct rec) + 2 * sizeof(struct key_idx)
+                                  : 3 * sizeof(struct rec);
+    long chunk = budget / n_process / rec_cost;
+    if (chunk < 1) {
+        chunk = 1;
+    }
+    int fan_in = budget / MERGE_BUF;
+    if (fan_in < 2) {
+        fan_in = 2;
+    }
+    if (fan_in > MAX_FAN_IN) {
+        fan_in = MAX_FAN_IN;
+    }
+
+    // number the pass 0 runs up front so workers need not report back
+    long n_runs = 0;
+    for (int pid = 0; pid < n_process; pid++) {
+        n_runs += (part_size(pid, size, n_process) + chunk - 1) / chunk;
+    }
+    stats_tasks(n_runs);
+    stats_phase(PHASE_SORT);
+    n_runs = 0;
+    for (int pid = 0; pid < n_process; pid++) {
+        long count = part_size(pid, size, n_process);
+        int res = fork();
+        if (res < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (res == 0) {
+            pin_worker(pid);
+            spill_runs(input_file, part_start(pid, size, n_process), count,
+                       chunk, n_runs, opts);
+            exit(0);
+        }
+        n_runs += (count + chunk - 1) / chunk;
+    }
+    wait_workers(n_process);
+    stats_phase(PHASE_MERGE);
+
+    // intermediate passes shrink the run count until one merge can finish
+    int pass = 0;
+    char name[512];
+    while (n_runs > fan_in) {
+        long next = 0;
+        for (long first = 0; first < n_runs; first += fan_in, next++) {
+            int k = n_runs - first < fan_in ? n_runs - first : fan_in;
+            run_name(name, sizeof(name), pass + 1, next);
+            merge_to(create(name), pass, first, k, &opts->order);
+        }
+        n_runs = next;
+        pass++;
+    }
+
+    int fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror(output_file);
+        exit(1);
+    }
+    merge_to(fd, pass, 0, n_runs, &opts->order);
+    stats_phase(PHASE_WRITE);
+    remove_runs();
+}
@@ -0,0 +1,14 @@
+#ifndef _EXTSORT_H
+#define _EXTSORT_H
+
+#include <stddef.h>
+#include "helper.h"
+
+/* Each input stream of a merge pass is read through a buffer this big. */
+#define MERGE_BUF (64 * 1024)
+/* Never merge more runs than this at once, to stay clear of fd limits. */
+#define MAX_FAN_IN 512
+
+void sort_external(char *input_file, char *output_file, long size,
+                   int n_process, size_t budget, struct psort_opts *opts);
+#endif /* _EXTSORT_H */
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "pool.h"
+#include "stats.h"
+#include "group.h"
+
+/* Group by word: sum the freq of every record with the same word, then
+ * sort the sums. Each worker routes the records of its slice of the
+ * input to the worker that owns their word's hash, as sample sort does
+ * by key. Every worker then sums its words in an open-addressing hash
+ * table, sorts the totals, and a co-ranked merge writes the output.
+ * The first record of a word gives the output its bytes.
+ */
+
+struct group {
+    struct rec *in;
+    long size;
+    int n;
+    long *count;            // count[w * n + p]: records of slice w for worker p
+    long *offset;           // where slice w writes worker p's next record
+    long *part;             // worker p's records start at part[p]
+    struct rec *parts;      // the records, grouped by worker
+    long *n_sums;           // distinct words worker p found, shared
+    struct run *runs;
+    struct rec *out;
+    long out_size;
+    struct psort_opts *opts;
+};
+
+/* FNV-1a over the word, up to its NUL. */
+static unsigned long word_hash(const struct rec *r) {
+    unsigned long h = 14695981039346656037UL;
+    for (int i = 0; i < SIZE && r->word[i] != '\0'; i++) {
+        h = (h ^ (unsigned char) r->word[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+static int owner(struct group *g, const struct rec *r) {
+    return word_hash(r) % g->n;
+}
+
+static void count_task(long w, void *arg) {
+    struct group *g = arg;
+    long first = part_start(w, g->size, g->n);
+    long last = first + part_size(w, g->size, g->n);
+    long *count = g->count + w * g->n;
+    for (long i = first; i < last; i++) {
+        count[owner(g, &g->in[i])]++;
+    }
+}
+
+static void scatter_task(long w, void *arg) {
+    struct group *g = arg;
+    long first = part_start(w, g->size, g->n);
+    long last = first + part_size(w, g->size, g->n);
+    long *pos = g->offset + w * g->n;
+    for (long i = first; i < last; i++) {
+        g->parts[pos[owner(g, &g->in[i])]++] = g->in[i];
+    }
+}
+
+/* Sum worker p's records by word, in place: its first n_sums records
+ * become one per word, in order of first appearance. Then sort them.
+ */
+static void sum_task(long p, void *arg) {
+    struct group *g = arg;
+    struct rec *recs = g->parts + g->part[p];
+    long n = g->part[p + 1] - g->part[p];
+    // at most half full, so probe runs stay short
+    long cap = 16;
+    while (cap < 2 * n) {
+        cap *= 2;
+    }
+    long *slot = malloc(cap * sizeof(long));
+    unsigned long *hash = malloc(cap * sizeof(unsigned long));
+    long *sum = malloc(n * sizeof(long));
+    if (slot == NULL || hash == NULL || (sum == NULL && n > 0)) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(slot, -1, cap * sizeof(long));
+    long n_sums = 0;
+    for (long i = 0; i < n; i++) {
+        unsigned long h = word_hash(&recs[i]);
+        long s = h & (cap - 1);
+        while (slot[s] != -1 && (hash[s] != h ||
+               strncmp(recs[slot[s]].word, recs[i].word, SIZE) != 0)) {
+            s = (s + 1) & (cap - 1);
+        }
+        if (slot[s] == -1) {
+            // records before i are all summed already, so n_sums <= i
+            slot[s] = n_sums;
+            hash[s] = h;
+            recs[n_sums] = recs[i];
+            sum[n_sums++] = recs[i].freq;
+        } else {
+            sum[slot[s]] += recs[i].freq;
+        }
+    }
+    for (long i = 0; i < n_sums; i++) {
+        // a total too big for an int is kept at INT_MAX
+        recs[i].freq = sum[i] > INT_MAX ? INT_MAX : sum[i] < INT_MIN ? INT_MIN : sum[i];
+    }
+    free(sum);
+    free(hash);
+    free(slot);
+    g->n_sums[p] = n_sums;
+    if (worker_sort(p, recs, n_sums, recs, g->opts) == -1) {
+        exit(1);
+    }
+}
+
+static void merge_task(long t, void *arg) {
+    struct group *g = arg;
+    long lo = part_start(t, g->out_size, g->n);
+    if (merge_slice(g->runs, g->n, lo, lo + part_size(t, g->out_size, g->n), g->out,
+                    &g->opts->order) == -1) {
+        exit(1);
+    }
+}
+
+void sort_grouped(char *input_file, char *output_file, long size, int n_workers,
+                  struct psort_opts *opts) {
+    if (size == 0) {
+        map_output(output_file, 0);
+        return;
+    }
+    void *base;
+    size_t len;
+    struct group g;
+    stats_phase(PHASE_READ);
+    g.in = map_part(input_file, 0, size, &base, &len);
+    g.size = size;
+    g.n = n_workers;
+    g.opts = opts;
+    // forked workers hand their counts and records back in shared memory
+    g.count = alloc_shared((long) n_workers * n_workers * sizeof(long));
+    g.n_sums = alloc_shared(n_workers * sizeof(long));
+    g.parts = alloc_shared(size * sizeof(struct rec));
+    g.offset = malloc((long) n_workers * n_workers * sizeof(long));
+    g.part = malloc((n_workers + 1) * sizeof(long));
+    g.runs = malloc(n_workers * sizeof(struct run));
+    if (g.offset == NULL || g.part == NULL || g.runs == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    stats_phase(PHASE_PARTITION);
+    run_workers(n_workers, opts->threads, count_task, &g);
+    long pos = 0;
+    for (int p = 0; p < n_workers; p++) {
+        g.part[p] = pos;
+        for (int w = 0; w < n_workers; w++) {
+            g.offset[w * n_workers + p] = pos;
+            pos += g.count[w * n_workers + p];
+        }
+    }
+    g.part[n_workers] = pos;
+    run_workers(n_workers, opts->threads, scatter_task, &g);
+
+    stats_tasks(n_workers);
+    stats_phase(PHASE_SORT);
+    run_workers(n_workers, opts->threads, sum_task, &g);
+
+    stats_phase(PHASE_MERGE);
+    g.out_size = 0;
+    for (int p = 0; p < n_workers; p++) {
+        g.runs[p].recs = g.parts + g.part[p];
+        g.runs[p].n = g.n_sums[p];
+        g.out_size += g.n_sums[p];
+    }
+    g.out = map_output(output_file, g.out_size);
+    run_workers(n_workers, opts->threads, merge_task, &g);
+
+    stats_phase(PHASE_WRITE);
+    if (opts->verbose) {
+        fprintf(stderr, "psort: %ld records, %ld distinct words\n", size, g.out_size);
+    }
+    free(g.runs);
+    free(g.part);
+    free(g.offset);
+    munmap(g.parts, size * sizeof(struct rec));
+    munmap(g.n_sums, n_workers * sizeof(long));
+    munmap(g.count, (long) n_workers * n_workers * sizeof(long));
+    munmap(base, len);
+    if (g.out_size > 0 && munmap(g.out, g.out_size * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+}
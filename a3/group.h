@@ -0,0 +1,8 @@
+#ifndef _GROUP_H
+#define _GROUP_H
+
+#include "helper.h"
+
+void sort_grouped(char *input_file, char *output_file, long size, int n_workers,
+                  struct psort_opts *opts);
+#endif /* _GROUP_H */
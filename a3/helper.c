@@ -1,11 +1,18 @@
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
 #include "helper.h"
+#include "stats.h"
+#include "aio.h"
 
 
-int get_file_size(char *filename) {
+off_t get_file_size(char *filename) {
     struct stat sbuf;
 
     if ((stat(filename, &sbuf)) == -1) {
@@ -16,6 +23,196 @@ int get_file_size(char *filename) {
     return sbuf.st_size;
 }
 
+/* Return the number of records worker pid sorts when size records are
+ * split between n_process workers. The first size % n_process workers
+ * take one extra record.
+ */
+long part_size(int pid, long size, int n_process) {
+    return size / n_process + (pid < size % n_process ? 1 : 0);
+}
+
+/* Return the index of the first record worker pid sorts. */
+long part_start(int pid, long size, int n_process) {
+    long rem = size % n_process;
+    return pid * (size / n_process) + (pid < rem ? pid : rem);
+}
+
+/* Map records [first, first + count) of filename privately, so a worker
+ * can read its slice without the parent copying it through a pipe.
+ * mmap offsets must be page aligned, so the mapping may start a little
+ * before the first record; base and len describe the whole mapping.
+ */
+struct rec *map_part(char *filename, long first, long count,
+                     void **base, size_t *len) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    off_t offset = first * sizeof(struct rec);
+    off_t aligned = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    *len = (offset - aligned) + (size_t) count * sizeof(struct rec);
+    *base = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, aligned);
+    if (*base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return (struct rec *) ((char *) *base + (offset - aligned));
+}
+
+/* Return a zeroed mapping of len bytes that forked workers share with the
+ * parent, so they can sort in it and the parent can merge straight out
+ * of it.
+ */
+void *alloc_shared(size_t len) {
+    void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return mem;
+}
+
+/* Create filename with room for size records and map it for writing. */
+struct rec *map_output(char *filename, long size) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    size_t len = size * sizeof(struct rec);
+    if (ftruncate(fd, len) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+    struct rec *out = NULL;
+    if (len > 0) {
+        out = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (out == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return out;
+}
+
+/* Return 1 if a and b are names of the same existing file. */
+int same_file(char *a, char *b) {
+    struct stat sa, sb;
+
+    if (stat(a, &sa) == -1 || stat(b, &sb) == -1) {
+        return 0;
+    }
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* Return the name to write output_file under. That is output_file itself,
+ * unless it is input_file and would be truncated while still being read:
+ * then it is a new file in the same directory that finish_output renames
+ * over output_file once the sort is done.
+ */
+char *output_name(char *input_file, char *output_file) {
+    if (!same_file(input_file, output_file)) {
+        return output_file;
+    }
+    // resolve links so the rename replaces the file, not the link
+    char *path = realpath(output_file, NULL);
+    char *name = path == NULL ? NULL : malloc(strlen(path) + 8);
+    if (name == NULL) {
+        perror(output_file);
+        exit(1);
+    }
+    sprintf(name, "%s.XXXXXX", path);
+    free(path);
+    int fd = mkstemp(name);
+    if (fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == -1 || stat(output_file, &sbuf) == -1 ||
+        fchmod(fd, sbuf.st_mode & 07777) == -1) {
+        perror(name);
+        unlink(name);
+        exit(1);
+    }
+    if (close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+    return name;
+}
+
+/* Move the output written under name, from output_name, to output_file. */
+void finish_output(char *name, char *output_file) {
+    if (name == output_file) {
+        return;
+    }
+    char *path = strdup(name);
+    if (path == NULL) {
+        perror("strdup");
+        exit(1);
+    }
+    path[strlen(path) - 7] = '\0';
+    if (rename(name, path) == -1) {
+        perror("rename");
+        unlink(name);
+        exit(1);
+    }
+    free(path);
+    free(name);
+}
+
+/* Wait for n forked workers and exit if any of them failed. */
+void wait_workers(int n) {
+    int status;
+    for (int i = 0; i < n; i++) {
+        if (wait(&status) == -1) {
+            perror("wait");
+            exit(1);
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "psort: a worker failed\n");
+            exit(1);
+        }
+    }
+}
+
+/* Parse a size such as 512M, 2G, 64K or a plain byte count.
+ * Return 0 if str is not a valid positive size.
+ */
+size_t parse_size(char *str) {
+    char *end;
+    long long n = strtoll(str, &end, 10);
+    if (end == str || n <= 0) {
+        return 0;
+    }
+    switch (*end) {
+    case 'G': case 'g':
+        n *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        n *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        n *= 1024;
+        end++;
+    }
+    if (*end != '\0') {
+        return 0;
+    }
+    return n;
+}
+
 /* A comparison function to use for qsort */
 int compare_freq(const void *rec1, const void *rec2) {
 
@@ -31,15 +228,661 @@ int compare_freq(const void *rec1, const void *rec2) {
     }
 }
 
-int min(struct rec *rec_array, int size){
-    int res = 0;
-    while (rec_array[res].freq < 0){
-        res++;
+/* Below this many records qsort beats setting up a histogram. */
+#define SMALL_SORT 64
+/* Counting sort is used while the key range is at most this many times
+ * the number of records, and never needs more than MAX_COUNTS counters.
+ */
+#define COUNT_RATIO 2
+#define MAX_COUNTS (1 << 24)
+
+static const char *algo_names[] = {"auto", "qsort", "counting", "radix", "merge"};
+
+/* Set *algo from its name on the command line. Return 0 on success. */
+int parse_algo(char *name, enum sort_algo *algo) {
+    for (int i = 0; i < sizeof(algo_names) / sizeof(algo_names[0]); i++) {
+        if (strcmp(name, algo_names[i]) == 0) {
+            *algo = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *algo_name(enum sort_algo algo) {
+    return algo_names[algo];
+}
+
+/* Stable counting sort of recs, whose keys all lie in [lo, lo + range).
+ * Return 0, or -1 if memory ran out, leaving recs as they were.
+ */
+static int counting_sort(struct rec *recs, long n, int lo, long range,
+                         const struct order *order) {
+    long *count = calloc(range + 1, sizeof(long));
+    struct rec *tmp = malloc(n * sizeof(struct rec));
+    if (count == NULL || tmp == NULL) {
+        perror("malloc");
+        free(tmp);
+        free(count);
+        return -1;
+    }
+    for (long i = 0; i < n; i++) {
+        count[rec_key(order, &recs[i]) - lo + 1]++;
+    }
+    for (long k = 1; k <= range; k++) {
+        count[k] += count[k - 1];
+    }
+    for (long i = 0; i < n; i++) {
+        tmp[count[rec_key(order, &recs[i]) - lo]++] = recs[i];
+    }
+    memcpy(recs, tmp, n * sizeof(struct rec));
+    free(tmp);
+    free(count);
+    return 0;
+}
+
+/* Stable LSD radix sort of recs on key - lo, one byte per pass. Only as
+ * many passes are made as the key range needs: two for mkwords output.
+ * Return 0, or -1 if memory ran out.
+ */
+static int radix_sort(struct rec *recs, long n, int lo, unsigned int span,
+                      const struct order *order) {
+    struct rec *tmp = malloc(n * sizeof(struct rec));
+    if (tmp == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    struct rec *src = recs, *dst = tmp;
+    for (int shift = 0; shift < 32 && (span >> shift) > 0; shift += 8) {
+        long count[257] = {0};
+        for (long i = 0; i < n; i++) {
+            count[(((unsigned int) rec_key(order, &src[i]) - lo) >> shift & 0xff) + 1]++;
+        }
+        for (int d = 1; d <= 256; d++) {
+            count[d] += count[d - 1];
+        }
+        for (long i = 0; i < n; i++) {
+            dst[count[((unsigned int) rec_key(order, &src[i]) - lo) >> shift & 0xff]++] = src[i];
+        }
+        struct rec *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != recs) {
+        memcpy(recs, src, n * sizeof(struct rec));
+    }
+    free(tmp);
+    return 0;
+}
+
+/* Resolve SORT_AUTO, and a counting sort the range is too wide for, to
+ * the engine that will actually sort n keys spanning span.
+ */
+static enum sort_algo pick_algo(enum sort_algo algo, long n, unsigned int span) {
+    if (algo == SORT_AUTO) {
+        if (n < SMALL_SORT) {
+            return SORT_QSORT;
+        }
+        return (span < MAX_COUNTS && span < COUNT_RATIO * n) ? SORT_COUNTING
+                                                            : SORT_RADIX;
+    }
+    if (algo == SORT_COUNTING && span >= MAX_COUNTS) {
+        return SORT_RADIX;
+    }
+    return algo;
+}
+
+/* Sort recs with a comparison sort: the order's own merge sort when the
+ * result must be stable, qsort otherwise. Store the engine in *used and
+ * return 0, or -1 if memory ran out.
+ */
+static int compare_sort(struct rec *recs, long n, enum sort_algo algo,
+                        const struct order *order, enum sort_algo *used) {
+    if (algo != SORT_MERGE && !order->stable) {
+        qsort(recs, n, sizeof(struct rec), order->cmp);
+        *used = SORT_QSORT;
+        return 0;
+    }
+    struct rec *tmp = malloc(n * sizeof(struct rec));
+    if (tmp == NULL && n > 0) {
+        perror("malloc");
+        return -1;
+    }
+    order->msort(recs, n, tmp);
+    free(tmp);
+    *used = SORT_MERGE;
+    return 0;
+}
+
+/* After sorting on rec_key(), sort every run of records with equal keys
+ * by the rest of the order. Return 0, or -1 if memory ran out.
+ */
+static int sort_ties(struct rec *recs, long n, const struct order *order) {
+    struct rec *tmp = NULL;
+    for (long lo = 0, hi; lo < n; lo = hi) {
+        int key = rec_key(order, &recs[lo]);
+        for (hi = lo + 1; hi < n && rec_key(order, &recs[hi]) == key; hi++)
+            ;
+        if (hi - lo < 2) {
+            continue;
+        }
+        if (!order->stable) {
+            qsort(recs + lo, hi - lo, sizeof(struct rec), order->tie);
+            continue;
+        }
+        if (tmp == NULL && (tmp = malloc(n * sizeof(struct rec))) == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        order->tie_msort(recs + lo, hi - lo, tmp);
+    }
+    free(tmp);
+    return 0;
+}
+
+/* Sort recs in the given order with the given engine and store the
+ * engine used in *used; for SORT_AUTO it depends on n and on the range
+ * of keys. Orders led by word always use a comparison sort. Return 0, or
+ * -1 if memory ran out, leaving the records of recs in some order.
+ */
+int sort_recs(struct rec *recs, long n, enum sort_algo algo,
+              const struct order *order, enum sort_algo *used) {
+    if (!order->by_freq || algo == SORT_QSORT || algo == SORT_MERGE ||
+        (algo == SORT_AUTO && n < SMALL_SORT)) {
+        return compare_sort(recs, n, algo, order, used);
+    }
+    *used = algo;
+    if (n == 0) {
+        return 0;
+    }
+    int lo = rec_key(order, &recs[0]), hi = lo;
+    for (long i = 1; i < n; i++) {
+        int key = rec_key(order, &recs[i]);
+        if (key < lo) {
+            lo = key;
+        } else if (key > hi) {
+            hi = key;
+        }
+    }
+    // the span can need all 32 bits when keys are negative
+    unsigned int span = (unsigned int) hi - (unsigned int) lo;
+    *used = pick_algo(algo, n, span);
+    int err = *used == SORT_COUNTING ? counting_sort(recs, n, lo, (long) span + 1, order)
+                                     : radix_sort(recs, n, lo, span, order);
+    if (err == 0 && order->tie != NULL) {
+        err = sort_ties(recs, n, order);
+    }
+    return err;
+}
+
+static int compare_key(const void *k1, const void *k2) {
+    const struct key_idx *a = k1, *b = k2;
+    if (a->freq != b->freq) {
+        return a->freq > b->freq ? 1 : -1;
+    }
+    return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+/* The key-only counterparts of counting_sort and radix_sort: they move
+ * 8-byte (key, index) pairs instead of whole records.
+ */
+static int counting_sort_keys(struct key_idx *keys, long n, int lo, long range) {
+    long *count = calloc(range + 1, sizeof(long));
+    struct key_idx *tmp = malloc(n * sizeof(struct key_idx));
+    if (count == NULL || tmp == NULL) {
+        perror("malloc");
+        free(tmp);
+        free(count);
+        return -1;
+    }
+    for (long i = 0; i < n; i++) {
+        count[keys[i].freq - lo + 1]++;
+    }
+    for (long k = 1; k <= range; k++) {
+        count[k] += count[k - 1];
+    }
+    for (long i = 0; i < n; i++) {
+        tmp[count[keys[i].freq - lo]++] = keys[i];
+    }
+    memcpy(keys, tmp, n * sizeof(struct key_idx));
+    free(tmp);
+    free(count);
+    return 0;
+}
+
+static int radix_sort_keys(struct key_idx *keys, long n, int lo, unsigned int span) {
+    struct key_idx *tmp = malloc(n * sizeof(struct key_idx));
+    if (tmp == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    struct key_idx *src = keys, *dst = tmp;
+    for (int shift = 0; shift < 32 && (span >> shift) > 0; shift += 8) {
+        long count[257] = {0};
+        for (long i = 0; i < n; i++) {
+            count[(((unsigned int) src[i].freq - lo) >> shift & 0xff) + 1]++;
+        }
+        for (int d = 1; d <= 256; d++) {
+            count[d] += count[d - 1];
+        }
+        for (long i = 0; i < n; i++) {
+            dst[count[((unsigned int) src[i].freq - lo) >> shift & 0xff]++] = src[i];
+        }
+        struct key_idx *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != keys) {
+        memcpy(keys, src, n * sizeof(struct key_idx));
+    }
+    free(tmp);
+    return 0;
+}
+
+/* Return 1 if the record keys a points at goes before the one b points
+ * at: by cmp, then by position, so the key order is always stable.
+ */
+static int key_before(struct rec *recs, int (*cmp)(const void *, const void *),
+                      struct key_idx *a, struct key_idx *b) {
+    int c = cmp(&recs[a->idx], &recs[b->idx]);
+    return c < 0 || (c == 0 && a->idx < b->idx);
+}
+
+/* Stable merge sort of keys by cmp on the records they point at. */
+static int merge_sort_keys(struct key_idx *keys, long n, struct rec *recs,
+                           int (*cmp)(const void *, const void *)) {
+    struct key_idx *tmp = malloc(n * sizeof(struct key_idx));
+    if (tmp == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    struct key_idx *src = keys, *dst = tmp;
+    for (long width = 1; width < n; width *= 2) {
+        for (long lo = 0; lo < n; lo += 2 * width) {
+            long mid = lo + width < n ? lo + width : n;
+            long hi = lo + 2 * width < n ? lo + 2 * width : n;
+            long i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                dst[k++] = key_before(recs, cmp, &src[j], &src[i]) ? src[j++] : src[i++];
+            }
+            while (i < mid) {
+                dst[k++] = src[i++];
+            }
+            while (j < hi) {
+                dst[k++] = src[j++];
+            }
+        }
+        struct key_idx *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != keys) {
+        memcpy(keys, src, n * sizeof(struct key_idx));
+    }
+    free(tmp);
+    return 0;
+}
+
+/* Sort n (key, index) pairs by key with the given engine, ties by index,
+ * and store the engine used in *used. Only the key and index are looked
+ * at, so the index can be any payload that rises in input order. Return
+ * 0, or -1 if memory ran out.
+ */
+int sort_keys(struct key_idx *keys, long n, enum sort_algo algo, enum sort_algo *used) {
+    int lo = n > 0 ? keys[0].freq : 0, hi = lo;
+    for (long i = 1; i < n; i++) {
+        if (keys[i].freq < lo) {
+            lo = keys[i].freq;
+        } else if (keys[i].freq > hi) {
+            hi = keys[i].freq;
+        }
+    }
+    unsigned int span = (unsigned int) hi - (unsigned int) lo;
+    *used = pick_algo(algo, n, span);
+    if (*used == SORT_QSORT || *used == SORT_MERGE) {
+        qsort(keys, n, sizeof(struct key_idx), compare_key);
+        return 0;
+    } else if (*used == SORT_COUNTING) {
+        return counting_sort_keys(keys, n, lo, (long) span + 1);
+    }
+    return radix_sort_keys(keys, n, lo, span);
+}
+
+/* Sort recs in the given order by building and sorting (key, index)
+ * pairs, leaving recs untouched. Store the sorted pairs in *out and the
+ * engine used in *used. A worker may sort at most 2^32 records this way.
+ * Equal records stay in input order whatever the engine. Return 0, or -1
+ * if memory ran out, with nothing stored in *out.
+ */
+int sort_index(struct rec *recs, long n, enum sort_algo algo,
+               const struct order *order, struct key_idx **out, enum sort_algo *used) {
+    struct key_idx *keys = malloc(n * sizeof(struct key_idx));
+    if (keys == NULL && n > 0) {
+        perror("malloc");
+        return -1;
+    }
+    for (long i = 0; i < n; i++) {
+        keys[i].freq = rec_key(order, &recs[i]);
+        keys[i].idx = i;
+    }
+    int err = 0;
+    if (!order->by_freq) {
+        *used = SORT_MERGE;
+        err = merge_sort_keys(keys, n, recs, order->cmp);
+    } else {
+        err = sort_keys(keys, n, algo, used);
+    }
+    if (order->by_freq && order->tie != NULL) {
+        for (long lo = 0, hi; err == 0 && lo < n; lo = hi) {
+            for (hi = lo + 1; hi < n && keys[hi].freq == keys[lo].freq; hi++)
+                ;
+            if (hi - lo > 1) {
+                err = merge_sort_keys(keys + lo, hi - lo, recs, order->tie);
+            }
+        }
+    }
+    if (err == -1) {
+        free(keys);
+        return -1;
+    }
+    *out = keys;
+    return 0;
+}
+
+/* Copy the records of src to dst in the order given by keys. */
+void gather(struct rec *src, struct key_idx *keys, long n, struct rec *dst) {
+    for (long i = 0; i < n; i++) {
+        dst[i] = src[keys[i].idx];
     }
-    for (int i = 0; i < size; i++){
-        if (rec_array[i].freq < rec_array[res].freq && rec_array[i].freq >= 0){
-            res = i;
+}
+
+/* When a worker's sort started, in wall and CPU time. */
+struct sort_clock {
+    struct timespec wall;
+    struct timespec cpu;
+};
+
+static void start_clock(struct sort_clock *clock) {
+    clock_gettime(CLOCK_MONOTONIC, &clock->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &clock->cpu);
+}
+
+static double ms_since(clockid_t id, struct timespec *start) {
+    struct timespec end;
+    clock_gettime(id, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 +
+           (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Record a worker's sort for --stats, and print it for -v. */
+static void report(int id, long n, enum sort_algo used, int index,
+                   struct sort_clock *clock, struct psort_opts *opts) {
+    double wall_ms = ms_since(CLOCK_MONOTONIC, &clock->wall);
+    double cpu_ms = ms_since(CLOCK_THREAD_CPUTIME_ID, &clock->cpu);
+    stats_task(id, n, algo_name(used), index, wall_ms, cpu_ms);
+    if (opts->verbose) {
+        fprintf(stderr, "worker %d: %ld records, %s sort%s, %.3f ms\n", id, n,
+                algo_name(used), index ? " of keys" : "", wall_ms);
+    }
+}
+
+/* Sort one worker's n records from src into dst, which may be src itself,
+ * timing the sort if opts asks for it. Return 0, or -1 if memory ran out;
+ * dst then holds src's records in some order.
+ */
+int worker_sort(int id, struct rec *src, long n, struct rec *dst,
+                struct psort_opts *opts) {
+    struct sort_clock clock;
+    start_clock(&clock);
+    enum sort_algo used;
+    if (opts->index) {
+        struct key_idx *keys;
+        if (sort_index(src, n, opts->algo, &opts->order, &keys, &used) == -1) {
+            if (dst != src) {
+                memcpy(dst, src, n * sizeof(struct rec));
+            }
+            return -1;
+        }
+        if (dst != src) {
+            gather(src, keys, n, dst);
+        } else if (n > 0) {
+            struct rec *tmp = malloc(n * sizeof(struct rec));
+            if (tmp == NULL) {
+                perror("malloc");
+                free(keys);
+                return -1;
+            }
+            gather(src, keys, n, tmp);
+            memcpy(dst, tmp, n * sizeof(struct rec));
+            free(tmp);
         }
+        free(keys);
+    } else {
+        if (dst != src) {
+            memcpy(dst, src, n * sizeof(struct rec));
+        }
+        if (sort_recs(dst, n, opts->algo, &opts->order, &used) == -1) {
+            return -1;
+        }
+    }
+    report(id, n, used, opts->index, &clock, opts);
+    return 0;
+}
+
+/* Sort one worker's n records and write them to out. With -i the records
+ * are gathered straight from recs into the writer, in order, so they are
+ * never permuted in memory.
+ */
+void worker_sort_to_file(int id, struct rec *recs, long n, struct writer *out,
+                         struct psort_opts *opts) {
+    if (!opts->index) {
+        if (worker_sort(id, recs, n, recs, opts) == -1) {
+            exit(1);
+        }
+        writer_put(out, recs, n * sizeof(struct rec));
+        return;
+    }
+    struct sort_clock clock;
+    start_clock(&clock);
+    struct key_idx *keys;
+    enum sort_algo used;
+    if (sort_index(recs, n, opts->algo, &opts->order, &keys, &used) == -1) {
+        exit(1);
+    }
+    for (long i = 0; i < n; i++) {
+        writer_put(out, &recs[keys[i].idx], sizeof(struct rec));
+    }
+    free(keys);
+    report(id, n, used, 1, &clock, opts);
+}
+
+/* Return 1 if run a's head record should be merged before run b's. */
+static int heap_less(struct merge_heap *heap, int a, int b) {
+    int c = order_cmp(heap->order, &heap->head[a], &heap->head[b]);
+    return c < 0 || (c == 0 && a < b);
+}
+
+/* Restore the heap property below position pos. */
+static void sift_down(struct merge_heap *heap, int pos) {
+    int *idx = heap->idx;
+    int run = idx[pos];
+    while (1) {
+        int child = 2 * pos + 1;
+        if (child >= heap->live) {
+            break;
+        }
+        if (child + 1 < heap->live && heap_less(heap, idx[child + 1], idx[child])) {
+            child++;
+        }
+        if (!heap_less(heap, idx[child], run)) {
+            break;
+        }
+        idx[pos] = idx[child];
+        pos = child;
+    }
+    idx[pos] = run;
+}
+
+/* Build a heap over the live runs listed in idx[0..live).
+ * Runs that are empty from the start should simply be left out of idx.
+ */
+void heap_init(struct merge_heap *heap, struct rec *head, int *idx, int live,
+               const struct order *order) {
+    heap->head = head;
+    heap->order = order;
+    heap->idx = idx;
+    heap->live = live;
+    for (int i = live / 2 - 1; i >= 0; i--) {
+        sift_down(heap, i);
+    }
+}
+
+/* Return the index of the run whose head record is the smallest. */
+int heap_top(struct merge_heap *heap) {
+    return heap->idx[0];
+}
+
+/* Call after head[heap_top()] has been replaced with the run's next record. */
+void heap_advance(struct merge_heap *heap) {
+    sift_down(heap, 0);
+}
+
+/* Call when the run at the top of the heap has no records left. */
+void heap_pop(struct merge_heap *heap) {
+    heap->live--;
+    if (heap->live > 0) {
+        heap->idx[0] = heap->idx[heap->live];
+        sift_down(heap, 0);
+    }
+}
+
+/* Merge the k sorted in-memory runs into out, which must have room for
+ * all of their records.
+ */
+void merge_runs(struct run *runs, int k, struct rec *out, const struct order *order) {
+    struct rec head[k];
+    int idx[k];
+    long pos[k];
+    int live = 0;
+    for (int i = 0; i < k; i++) {
+        pos[i] = 0;
+        if (runs[i].n > 0) {
+            head[i] = runs[i].recs[0];
+            idx[live++] = i;
+        }
+    }
+    struct merge_heap heap;
+    heap_init(&heap, head, idx, live, order);
+    while (heap.live > 0) {
+        int top = heap_top(&heap);
+        *out++ = head[top];
+        if (++pos[top] < runs[top].n) {
+            head[top] = runs[top].recs[pos[top]];
+            heap_advance(&heap);
+        } else {
+            heap_pop(&heap);
+        }
+    }
+}
+
+/* Return 1 if record x of run a comes before record y of run b in the
+ * merged output. Equal keys are ordered by run, then by position, which
+ * is the order merge_runs() produces them in.
+ */
+static int rec_before(struct run *runs, int a, long x, int b, long y,
+                      const struct order *order) {
+    int c = order_cmp(order, &runs[a].recs[x], &runs[b].recs[y]);
+    return c < 0 || (c == 0 && (a < b || (a == b && x < y)));
+}
+
+/* Return the number of records in run i, between lo and hi, that come
+ * before record m of run j.
+ */
+static long rank_in(struct run *runs, int i, long lo, long hi, int j, long m,
+                    const struct order *order) {
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (rec_before(runs, i, mid, j, m, order)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Co-ranking: find how many records of each run land in the first p
+ * records of the merged output, and store them in cut[0..k).
+ * Every round takes the middle record of the widest remaining range as a
+ * pivot and ranks it in every run. The pivot falls either inside the
+ * first p records or outside them, which halves that run's range and
+ * narrows the others. That takes O(k log n) rounds of k binary searches
+ * each, so O(k^2 log n) searches and O(k^2 log^2 n) comparisons in all.
+ */
+void corank(struct run *runs, int k, long p, long *cut, const struct order *order) {
+    long lo[k];
+    for (int i = 0; i < k; i++) {
+        lo[i] = 0;
+        cut[i] = runs[i].n;
+    }
+    while (1) {
+        int j = -1;
+        long widest = 0;
+        for (int i = 0; i < k; i++) {
+            if (cut[i] - lo[i] > widest) {
+                widest = cut[i] - lo[i];
+                j = i;
+            }
+        }
+        if (j == -1) {
+            return;
+        }
+        long m = lo[j] + widest / 2;
+        long rank[k];
+        long before = 0;
+        for (int i = 0; i < k; i++) {
+            rank[i] = (i == j) ? m : rank_in(runs, i, lo[i], cut[i], j, m, order);
+            before += rank[i];
+        }
+        if (before < p) {
+            // the pivot and everything before it are in the first p
+            for (int i = 0; i < k; i++) {
+                lo[i] = rank[i];
+            }
+            lo[j] = m + 1;
+        } else {
+            for (int i = 0; i < k; i++) {
+                cut[i] = rank[i];
+            }
+        }
+    }
+}
+
+/* Write records [lo, hi) of the merge of the k runs to out[lo..hi).
+ * Slices of one merge can be written independently and in parallel.
+ * Return 0, or -1 if memory ran out.
+ */
+int merge_slice(struct run *runs, int k, long lo, long hi, struct rec *out,
+                const struct order *order) {
+    long *start = malloc(k * sizeof(long));
+    long *end = malloc(k * sizeof(long));
+    struct run *part = malloc(k * sizeof(struct run));
+    if (start == NULL || end == NULL || part == NULL) {
+        perror("malloc");
+        free(part);
+        free(end);
+        free(start);
+        return -1;
+    }
+    corank(runs, k, lo, start, order);
+    corank(runs, k, hi, end, order);
+    for (int i = 0; i < k; i++) {
+        part[i].recs = runs[i].recs + start[i];
+        part[i].n = end[i] - start[i];
     }
-    return res;
+    merge_runs(part, k, out + lo, order);
+    free(part);
+    free(end);
+    free(start);
+    return 0;
 }
@@ -1,14 +1,87 @@
 #ifndef _HELPER_H
 #define _HELPER_H
 
-#define SIZE 44
+#include <stdio.h>
+#include <sys/types.h>
+#include "order.h"
 
-struct rec {
+off_t get_file_size(char *filename);
+long part_size(int pid, long size, int n_process);
+long part_start(int pid, long size, int n_process);
+struct rec *map_part(char *filename, long first, long count,
+                     void **base, size_t *len);
+void *alloc_shared(size_t len);
+struct rec *map_output(char *filename, long size);
+int same_file(char *a, char *b);
+char *output_name(char *input_file, char *output_file);
+void finish_output(char *name, char *output_file);
+void wait_workers(int n);
+size_t parse_size(char *str);
+int compare_freq(const void *rec1, const void *rec2);
+
+/* The integer sort key of r; ~freq reverses the order of every int. */
+static inline int rec_key(const struct order *order, const struct rec *r) {
+    return order->desc ? ~r->freq : r->freq;
+}
+
+/* Compare a and b in the given order, with the integer key inline. */
+static inline int order_cmp(const struct order *order, const struct rec *a,
+                            const struct rec *b) {
+    if (order->by_freq) {
+        int ka = rec_key(order, a), kb = rec_key(order, b);
+        if (ka != kb) {
+            return ka < kb ? -1 : 1;
+        }
+    }
+    return order->tie == NULL ? 0 : order->tie(a, b);
+}
+
+const char *algo_name(enum sort_algo algo);
+
+/* A record's rec_key() and its position, sorted instead of the record. */
+struct key_idx {
     int freq;
-    char word[SIZE];
+    unsigned int idx;
 };
 
-int get_file_size(char *filename);
-int compare_freq(const void *rec1, const void *rec2);
-int min(struct rec *rec_array, int size);
+int sort_recs(struct rec *recs, long n, enum sort_algo algo,
+              const struct order *order, enum sort_algo *used);
+int sort_keys(struct key_idx *keys, long n, enum sort_algo algo, enum sort_algo *used);
+int sort_index(struct rec *recs, long n, enum sort_algo algo,
+               const struct order *order, struct key_idx **out, enum sort_algo *used);
+void gather(struct rec *src, struct key_idx *keys, long n, struct rec *dst);
+int worker_sort(int id, struct rec *src, long n, struct rec *dst,
+                struct psort_opts *opts);
+struct writer;
+void worker_sort_to_file(int id, struct rec *recs, long n, struct writer *out,
+                         struct psort_opts *opts);
+
+/* A binary min-heap over the runs of a k-way merge.
+ * head[i] holds the next unmerged record of run i, and idx[0..live) holds
+ * the indices of the runs that still have records, ordered by head[] in
+ * the given order. Ties go to the lower run index so the merge is stable.
+ */
+struct merge_heap {
+    struct rec *head;
+    int *idx;
+    int live;
+    const struct order *order;
+};
+
+void heap_init(struct merge_heap *heap, struct rec *head, int *idx, int live,
+               const struct order *order);
+int heap_top(struct merge_heap *heap);
+void heap_advance(struct merge_heap *heap);
+void heap_pop(struct merge_heap *heap);
+
+/* A sorted run of n records held in memory. */
+struct run {
+    struct rec *recs;
+    long n;
+};
+
+void merge_runs(struct run *runs, int k, struct rec *out, const struct order *order);
+void corank(struct run *runs, int k, long p, long *cut, const struct order *order);
+int merge_slice(struct run *runs, int k, long lo, long hi, struct rec *out,
+                const struct order *order);
 #endif /* _HELPER_H */
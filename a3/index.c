@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "compact.h"
+#include "index.h"
+
+/* Fill name with the path of the index of filename. */
+void index_name(char *name, size_t len, char *filename) {
+    snprintf(name, len, "%s.idx", filename);
+}
+
+/* Write the sparse index of filename, a file psort has just sorted in
+ * the given order, in either record format.
+ */
+void write_index(char *filename, const struct order *order) {
+    struct index_header hdr;
+    memcpy(hdr.magic, INDEX_MAGIC, 4);
+    long count = compact_count(filename);
+    hdr.compact = count != -1;
+    hdr.count = hdr.compact ? count : get_file_size(filename) / sizeof(struct rec);
+    hdr.by_freq = order->by_freq;
+    hdr.desc = order->desc;
+    hdr.block = INDEX_BLOCK;
+    hdr.n_blocks = (hdr.count + INDEX_BLOCK - 1) / INDEX_BLOCK;
+
+    char name[4096];
+    index_name(name, sizeof(name), filename);
+    FILE *ofp = fopen(name, "w");
+    if (ofp == NULL) {
+        perror(name);
+        exit(1);
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, ofp) != 1) {
+        perror("fwrite");
+        exit(1);
+    }
+    size_t len = get_file_size(filename);
+    char *base = NULL;
+    if (hdr.count > 0) {
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        if ((base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        close(fd);
+    }
+    // only the freq of each record is read, whatever its format
+    size_t stride = hdr.compact ? sizeof(struct v2_rec) : sizeof(struct rec);
+    char *first = hdr.compact ? base + sizeof(struct v2_header) : base;
+    for (long b = 0; b < hdr.n_blocks; b++) {
+        long lo = b * INDEX_BLOCK;
+        long hi = lo + INDEX_BLOCK < hdr.count ? lo + INDEX_BLOCK : hdr.count;
+        struct index_block blk;
+        blk.min_freq = blk.max_freq = *(int *) (first + lo * stride);
+        for (long i = lo + 1; i < hi; i++) {
+            int freq = *(int *) (first + i * stride);
+            if (freq < blk.min_freq) {
+                blk.min_freq = freq;
+            } else if (freq > blk.max_freq) {
+                blk.max_freq = freq;
+            }
+        }
+        if (fwrite(&blk, sizeof(blk), 1, ofp) != 1) {
+            perror("fwrite");
+            exit(1);
+        }
+    }
+    if (base != NULL) {
+        munmap(base, len);
+    }
+    if (fclose(ofp) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+#include "helper.h"
+
+/* A sparse index of a sorted file, written next to it as <file>.idx.
+ * It holds one entry per block of INDEX_BLOCK records, giving the range
+ * of freq values in the block, so a query can skip every block that
+ * cannot hold a match. When the file is sorted by freq first the blocks
+ * are in order too, and a query binary searches them.
+ */
+#define INDEX_MAGIC "PSX1"
+#define INDEX_BLOCK 1024
+
+struct index_header {
+    char magic[4];
+    int compact;            // the file is in the v2 format
+    int by_freq;            // sorted by freq first...
+    int desc;               // ...descending
+    long count;             // records in the file
+    long block;             // records per block
+    long n_blocks;
+};
+
+struct index_block {
+    int min_freq;
+    int max_freq;
+};
+
+void index_name(char *name, size_t len, char *filename);
+void write_index(char *filename, const struct order *order);
+#endif /* _INDEX_H */
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "helper.h"
+#include "cpu.h"
+#include "pool.h"
+#include "stats.h"
+#include "stream.h"
+#include "engine.h"
+#include "libpsort.h"
+
+/* Nothing here exits: every entry point returns -1, or NULL, with errno
+ * set when it fails, and leaves the caller's process as it found it.
+ */
+
+/* The sort is cut into about this many tasks per thread so work
+ * stealing can even out the load...
+ */
+#define TASKS_PER_THREAD 8
+/* ...but no task is smaller than this many records. */
+#define MIN_TASK 4096
+
+struct thread_sort {
+    struct run *runs;
+    long n_runs;
+    struct rec *out;
+    long size;
+    long n_slices;      // the merge is split into this many output slices,
+                        // each of which co-ranks all n_runs runs
+    struct psort_opts *opts;
+    int failed;         // a task ran out of memory
+};
+
+static void sort_task(long t, void *arg) {
+    struct thread_sort *ts = arg;
+    if (worker_sort(t, ts->runs[t].recs, ts->runs[t].n, ts->runs[t].recs,
+                    ts->opts) == -1) {
+        __atomic_store_n(&ts->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void merge_task(long t, void *arg) {
+    struct thread_sort *ts = arg;
+    long lo = part_start(t, ts->size, ts->n_slices);
+    if (merge_slice(ts->runs, ts->n_runs, lo, lo + part_size(t, ts->size, ts->n_slices),
+                    ts->out, &ts->opts->order) == -1) {
+        __atomic_store_n(&ts->failed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Set opts to psort's defaults: freq:asc, not stable, any engine. */
+void psort_defaults(struct psort_opts *opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->algo = SORT_AUTO;
+    parse_order("freq:asc", &opts->order);
+}
+
+/* Sort the n records of recs into out with a pool of n_threads threads.
+ * recs is cut into many more slices than threads; the pool sorts the
+ * slices in place, then merges them into out one co-ranked output slice
+ * per thread. Co-ranking a slice costs a binary search in every run, so
+ * cutting the merge as finely as the sort would make it grow with the
+ * square of the thread count. Return 0, or -1 if memory ran out; recs
+ * then holds its records in some order.
+ */
+int sort_buffer(struct rec *recs, long n, struct rec *out, int n_threads,
+                struct psort_opts *opts) {
+    if (n == 0) {
+        return 0;
+    }
+    long n_tasks = (long) n_threads * TASKS_PER_THREAD;
+    if (n / n_tasks < MIN_TASK) {
+        n_tasks = (n + MIN_TASK - 1) / MIN_TASK;
+    }
+    struct run *runs = malloc(n_tasks * sizeof(struct run));
+    if (runs == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (long t = 0; t < n_tasks; t++) {
+        runs[t].recs = recs + part_start(t, n, n_tasks);
+        runs[t].n = part_size(t, n, n_tasks);
+    }
+    long n_slices = n_threads < n_tasks ? n_threads : n_tasks;
+    struct thread_sort ts = {runs, n_tasks, out, n, n_slices, opts, 0};
+    stats_tasks(n_tasks);
+    stats_phase(PHASE_SORT);
+    pool_run(n_threads, n_tasks, sort_task, &ts);
+    if (!ts.failed) {
+        stats_phase(PHASE_MERGE);
+        pool_run(n_threads, ts.n_slices, merge_task, &ts);
+    }
+    free(runs);
+    if (ts.failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* Sort the n records of buf in place. Return 0, or -1 if memory ran out;
+ * buf then holds the same records in some order.
+ */
+int psort_sort(struct rec *buf, size_t n, int n_threads, struct psort_opts *opts) {
+    if (n == 0) {
+        return 0;
+    }
+    if (n_threads <= 0) {
+        n_threads = auto_workers(n);
+    }
+    struct rec *tmp = malloc(n * sizeof(struct rec));
+    if (tmp == NULL) {
+        return -1;
+    }
+    if (sort_buffer(buf, n, tmp, n_threads, opts) == -1) {
+        free(tmp);
+        return -1;
+    }
+    memcpy(buf, tmp, n * sizeof(struct rec));
+    free(tmp);
+    return 0;
+}
+
+/* A stream collects pushed records into batches of STREAM_BATCH, which
+ * its threads sort while more arrive, as psort -f - does. The first pull
+ * ends the input and merges the batches. Once a call has failed the
+ * stream is broken: every later push and pull fails too.
+ */
+struct psort_stream {
+    struct stream st;
+    struct rec *batch;      // the batch being filled
+    long fill;
+    int merged;             // pulling has begun, so pushing is over
+    int failed;
+    struct rec *out;        // the merged records
+    long pulled;
+};
+
+/* Queue the batch being filled, if it holds any records. Return 0, or -1
+ * if it could not be queued and is still ours.
+ */
+static int queue_batch(struct psort_stream *ps) {
+    if (ps->fill > 0 && stream_add(&ps->st, ps->batch, ps->fill) == -1) {
+        return -1;
+    }
+    if (ps->fill == 0) {
+        free(ps->batch);
+    }
+    ps->batch = NULL;
+    ps->fill = 0;
+    return 0;
+}
+
+/* Return a new stream that sorts on n_threads threads in opts' order, or
+ * NULL if it could not be started.
+ */
+struct psort_stream *psort_open(int n_threads, struct psort_opts *opts) {
+    struct psort_stream *ps = calloc(1, sizeof(struct psort_stream));
+    if (ps == NULL) {
+        return NULL;
+    }
+    if (stream_open(&ps->st, n_threads > 0 ? n_threads : online_cpus(), opts) == -1) {
+        free(ps);
+        return NULL;
+    }
+    return ps;
+}
+
+/* Add the n records of recs to the stream. Return 0, or -1 if the stream
+ * is already being pulled (EINVAL) or memory ran out.
+ */
+int psort_push(struct psort_stream *ps, const struct rec *recs, size_t n) {
+    if (ps->merged || ps->failed) {
+        errno = ps->failed ? ENOMEM : EINVAL;
+        return -1;
+    }
+    while (n > 0) {
+        if (ps->batch == NULL &&
+            (ps->batch = malloc(STREAM_BATCH * sizeof(struct rec))) == NULL) {
+            ps->failed = 1;
+            return -1;
+        }
+        long room = STREAM_BATCH - ps->fill;
+        long take = n < room ? n : room;
+        memcpy(ps->batch + ps->fill, recs, take * sizeof(struct rec));
+        ps->fill += take;
+        recs += take;
+        n -= take;
+        if (ps->fill == STREAM_BATCH && queue_batch(ps) == -1) {
+            ps->failed = 1;
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* End the input, wait for the batches to be sorted and merge them.
+ * Return 0, or -1 if memory ran out.
+ */
+static int merge_stream(struct psort_stream *ps) {
+    int err = queue_batch(ps);
+    if (stream_finish(&ps->st) == -1 || err == -1) {
+        return -1;
+    }
+    ps->out = malloc(ps->st.size * sizeof(struct rec));
+    if (ps->out == NULL && ps->st.size > 0) {
+        return -1;
+    }
+    return stream_merge(&ps->st, ps->out);
+}
+
+/* Copy the next at most max records of the order into out and return how
+ * many were copied; 0 once every record has been pulled, -1 if the sort
+ * ran out of memory.
+ */
+ssize_t psort_pull(struct psort_stream *ps, struct rec *out, size_t max) {
+    if (!ps->merged && !ps->failed) {
+        ps->merged = 1;
+        if (merge_stream(ps) == -1) {
+            ps->failed = 1;
+        }
+    }
+    if (ps->failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t n = ps->st.size - ps->pulled;
+    if (n > max) {
+        n = max;
+    }
+    if (n > 0) {
+        memcpy(out, ps->out + ps->pulled, n * sizeof(struct rec));
+        ps->pulled += n;
+    }
+    return n;
+}
+
+/* Free the stream, whether or not all of it was pulled. */
+void psort_close(struct psort_stream *ps) {
+    if (!ps->merged) {
+        queue_batch(ps);
+        stream_finish(&ps->st);
+    }
+    stream_close(&ps->st);
+    free(ps->batch);        // left over if it could not be queued
+    free(ps->out);
+    free(ps);
+}
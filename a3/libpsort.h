@@ -0,0 +1,25 @@
+#ifndef _LIBPSORT_H
+#define _LIBPSORT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "order.h"
+
+/* The in-process interface to psort, built as libpsort.a, for programs
+ * that hold their records in memory. psort_sort() sorts a buffer; a
+ * psort_stream takes records pushed in any number of pieces and hands
+ * them back in order once the caller starts pulling. Both run the
+ * thread backend's engine in the calling process. A thread count of 0
+ * or less picks one the way psort -n auto does. On failure the calls
+ * return -1, or NULL, and set errno; none of them exits.
+ */
+
+struct psort_stream;
+
+void psort_defaults(struct psort_opts *opts);
+int psort_sort(struct rec *buf, size_t n, int n_threads, struct psort_opts *opts);
+struct psort_stream *psort_open(int n_threads, struct psort_opts *opts);
+int psort_push(struct psort_stream *ps, const struct rec *recs, size_t n);
+ssize_t psort_pull(struct psort_stream *ps, struct rec *out, size_t max);
+void psort_close(struct psort_stream *ps);
+#endif /* _LIBPSORT_H */
@@ -4,17 +4,172 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <fcntl.h>
 #include "helper.h"
+#include "pool.h"
+#include "compact.h"
 
 #define UPPER 30000
 
+/* Each thread writes records this many at a time. */
+#define OUT_BATCH 16384
+
+#define USAGE "Usage: mkwords -f <input file name> -o <output file name> " \
+              "[-c <records>] [-s <seed>] [-t <threads>] [-2]\n" \
+              "               [-d uniform|zipf|sorted|reverse|dups|wide]\n"
+
+/* How the frequency counts are distributed. */
+enum dist {
+    DIST_UNIFORM,       // uniform in [0, UPPER]
+    DIST_ZIPF,          // Zipfian in [0, UPPER], small counts most common
+    DIST_SORTED,        // rising from 0 to UPPER in output order
+    DIST_REVERSE,       // falling from UPPER to 0 in output order
+    DIST_DUPS,          // every record has the same count
+    DIST_WIDE           // uniform over every non-negative int
+};
+
+static char *dist_names[] = {
+    "uniform", "zipf", "sorted", "reverse", "dups", "wide"
+};
 
 /*
  * Return a randomly generated number, uniformly distributed between
  * lower and upper.
  */
-int uniform(int lower,int upper) {
-    return (int) (floor ( drand48() * (upper - lower + 1) ) + lower);
+int uniform(int lower, int upper, unsigned short *seed) {
+    return (int) (floor ( erand48(seed) * (upper - lower + 1) ) + lower);
+}
+
+/* Return the frequency of record i of n under dist. */
+int make_freq(enum dist dist, long i, long n, unsigned short *seed) {
+    switch (dist) {
+    case DIST_ZIPF:
+        // rank r in [1, UPPER + 1] with P(r) roughly proportional to 1/r
+        return (int) floor(pow(UPPER + 1, erand48(seed))) - 1;
+    case DIST_SORTED:
+        return (int) (i * (UPPER + 1) / n);
+    case DIST_REVERSE:
+        return UPPER - (int) (i * (UPPER + 1) / n);
+    case DIST_DUPS:
+        return UPPER / 2;
+    case DIST_WIDE:
+        return (int) (erand48(seed) * 2147483648.0);
+    default:
+        return uniform(0, UPPER, seed);
+    }
+}
+
+/* Read the words of infp, one per line, into an array of *n_words
+ * records with their counts left unset.
+ */
+struct rec *read_words(FILE *infp, long *n_words) {
+    long cap = 1024, n = 0;
+    struct rec *words = malloc(cap * sizeof(struct rec));
+    if (words == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    struct rec record;
+    memset(&record, 0, sizeof(record));
+    while ((fgets(record.word, sizeof(record.word), infp)) != NULL) {
+        // remove the newline character
+        record.word[strcspn(record.word, "\n")] = '\0';
+        if (n == cap) {
+            cap *= 2;
+            if ((words = realloc(words, cap * sizeof(struct rec))) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        words[n++] = record;
+        memset(&record, 0, sizeof(record));
+    }
+    *n_words = n;
+    return words;
+}
+
+/* The seed fills all of erand48's state, so it must be below 2^48. */
+#define SEED_BITS 48
+
+/* The output is cut into one range of records per thread. Each thread
+ * draws from its own generator, seeded from the seed and its number, so
+ * the same seed and thread count always make the same file.
+ */
+
+struct gen {
+    struct rec *words;
+    long n_words;
+    long count;
+    int n_threads;
+    long seed;
+    enum dist dist;
+    int fd;
+    char *outfile;
+    int v2;                 // write the v2 format
+    long *pool_at;          // v2: where word i starts in the words' cycle
+};
+
+/* The offset in the v2 pool of the word of record i. */
+static long pool_offset(struct gen *g, long i) {
+    return i / g->n_words * g->pool_at[g->n_words] + g->pool_at[i % g->n_words];
+}
+
+/* Write len bytes of buf to fd at offset. */
+static void write_at(struct gen *g, void *buf, size_t len, off_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t w = pwrite(g->fd, p, len, offset);
+        if (w == -1) {
+            fprintf(stderr, "Could not write to %s\n", g->outfile);
+            exit(1);
+        }
+        p += w;
+        offset += w;
+        len -= w;
+    }
+}
+
+static void gen_task(long t, void *arg) {
+    struct gen *g = arg;
+    // spread the threads' states apart, keeping every bit of the seed
+    unsigned long x = g->seed ^ ((t * 0x9e3779b97f4a7c15UL) >> (64 - SEED_BITS));
+    unsigned short state[3] = {x & 0xffff, (x >> 16) & 0xffff, (x >> 32) & 0xffff};
+    long first = part_start(t, g->count, g->n_threads);
+    long last = first + part_size(t, g->count, g->n_threads);
+    struct rec *batch = malloc(OUT_BATCH * sizeof(struct rec));
+    struct v2_rec *entries = malloc(OUT_BATCH * sizeof(struct v2_rec));
+    char *words = malloc(OUT_BATCH * (SIZE + 1));
+    if (batch == NULL || entries == NULL || words == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (long done = first; done < last; done += OUT_BATCH) {
+        long n = last - done < OUT_BATCH ? last - done : OUT_BATCH;
+        for (long i = 0; i < n; i++) {
+            batch[i] = g->words[(done + i) % g->n_words];
+            batch[i].freq = make_freq(g->dist, done + i, g->count, state);
+        }
+        if (!g->v2) {
+            write_at(g, batch, n * sizeof(struct rec), done * sizeof(struct rec));
+            continue;
+        }
+        // v2: the entries, then the words they point at into the pool
+        long first_word = pool_offset(g, done), len = 0;
+        for (long i = 0; i < n; i++) {
+            entries[i].freq = batch[i].freq;
+            entries[i].word = first_word + len;
+            size_t w = strlen(batch[i].word) + 1;
+            memcpy(words + len, batch[i].word, w);
+            len += w;
+        }
+        write_at(g, entries, n * sizeof(struct v2_rec),
+                 sizeof(struct v2_header) + done * sizeof(struct v2_rec));
+        write_at(g, words, len, sizeof(struct v2_header) +
+                 g->count * sizeof(struct v2_rec) + first_word);
+    }
+    free(words);
+    free(entries);
+    free(batch);
 }
 
 /* This program takes as input a file containing one word per line.  
@@ -22,25 +177,33 @@ int uniform(int lower,int upper) {
  * to create a struct that is written to the output file.
  * The result is a binary file in the correct format to use as input to
  * psort.
+ *
+ * With -c it writes that many records, cycling through the words, so a
+ * short word list can make a file of any size. -d picks how the counts
+ * are distributed, and -s seeds the generator so a data set can be made
+ * again exactly. -t writes the file with that many threads; the file
+ * depends on the thread count as well as the seed. -2 writes the compact
+ * v2 format instead of 48-byte records.
  * 
- * To compile the program the math library must be linked:
- *          gcc -Wall -g -std=gnu99 -o mkwords mkwords.c -lm
+ * To compile the program the math library must be linked; make mkwords
+ * does this:
+ *          gcc -Wall -g -std=gnu99 -pthread -o mkwords mkwords.c helper.c pool.c \
+ *              order.c stats.c compact.c aio.c cpu.c -lm
  */
 
 int main(int argc, char *argv[]) {
     extern char *optarg;
     int ch;
-    FILE *infp, *outfp;
-    struct rec record;
+    FILE *infp;
     char *infile = NULL, *outfile = NULL;
-
-    if (argc != 5) {
-        fprintf(stderr, "Usage: mkwords -f <input file name> -o <output file name>\n");
-        exit(1);
-    }
+    long count = -1;
+    long seed = time(NULL);
+    enum dist dist = DIST_UNIFORM;
+    int n_threads = 1;
+    int v2 = 0;
 
     /* read in arguments */
-    while ((ch = getopt(argc, argv, "f:o:")) != -1) {
+    while ((ch = getopt(argc, argv, "f:o:c:s:d:t:2")) != -1) {
         switch(ch) {
         case 'f':
             infile = optarg;
@@ -48,45 +211,113 @@ int main(int argc, char *argv[]) {
         case 'o':
             outfile = optarg;
             break;
+        case 'c':
+            if ((count = strtol(optarg, NULL, 10)) < 0) {
+                fprintf(stderr, "mkwords: bad record count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            seed = strtol(optarg, NULL, 10);
+            if (seed < 0 || seed >= 1L << SEED_BITS) {
+                fprintf(stderr, "mkwords: seed %s is not in [0, 2^48)\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            for (dist = 0; dist <= DIST_WIDE; dist++) {
+                if (strcmp(optarg, dist_names[dist]) == 0) {
+                    break;
+                }
+            }
+            if (dist > DIST_WIDE) {
+                fprintf(stderr, "mkwords: unknown distribution %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            if ((n_threads = strtol(optarg, NULL, 10)) <= 0) {
+                fprintf(stderr, "mkwords: bad thread count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case '2':
+            v2 = 1;
+            break;
         default:
-            fprintf(stderr, "Usage: mkwords -f <input file name> -o <output file name>\n");
+            fprintf(stderr, USAGE);
             exit(1);
         }
     }
-
-    /* seed the random number generator */
-    
-    srand48(time(NULL)); 
+    if (infile == NULL || outfile == NULL) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
 
     if ((infp = fopen(infile, "r")) == NULL) {
         fprintf(stderr, "Could not open %s\n", infile);
         exit(1);
     }
-    if ((outfp = fopen(outfile, "w")) == NULL) {
+    long n_words;
+    struct rec *words = read_words(infp, &n_words);
+    if (count == -1) {
+        count = n_words;
+    }
+    if (count > 0 && n_words == 0) {
+        fprintf(stderr, "No words in %s\n", infile);
+        exit(1);
+    }
+    int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
         fprintf(stderr, "Could not open %s\n", outfile);
         exit(1);
     }
-
-    /* read a word from the input file, and make up a frequency for it */
-	/* Expects the input file to have one word per line */
-    while ((fgets(record.word, sizeof(record.word), infp)) != NULL) {
-		// remove the newline character
-        record.word[strlen(record.word) - 1] = '\0';
-        record.freq = uniform(0, UPPER);
-
-        if ((fwrite(&record, sizeof(record), 1, outfp)) != 1) {
-            fprintf(stderr, "Could not write to %s\n", outfile);
+    struct gen g = {words, n_words, count, n_threads, seed, dist, fd, outfile,
+                    v2, NULL};
+    off_t size = count * sizeof(struct rec);
+    struct v2_header hdr;
+    if (v2) {
+        // every thread can find its words' place in the pool from these
+        if ((g.pool_at = malloc((n_words + 1) * sizeof(long))) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        g.pool_at[0] = 0;
+        for (long i = 0; i < n_words; i++) {
+            g.pool_at[i + 1] = g.pool_at[i] + strlen(words[i].word) + 1;
         }
+        memcpy(hdr.magic, V2_MAGIC, 4);
+        hdr.version = V2_VERSION;
+        hdr.count = count;
+        hdr.pool_size = n_words == 0 ? 0 : pool_offset(&g, count);
+        if (hdr.pool_size > 0xffffffffL) {
+            fprintf(stderr, "mkwords: the words need more than 4GB\n");
+            exit(1);
+        }
+        size = sizeof(hdr) + count * sizeof(struct v2_rec) + hdr.pool_size;
+    }
+    // size the file first, so every thread can write its range in place
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        exit(1);
     }
 
+    /* give each word a frequency, every thread over its own range */
+    pool_run(n_threads, n_threads, gen_task, &g);
+    if (v2) {
+        write_at(&g, &hdr, sizeof(hdr), 0);
+        free(g.pool_at);
+    }
+    free(words);
+
     /* Close both files. */
     if (fclose(infp)) {
         perror("fclose");
         exit(1);
     }
 
-    if (fclose(outfp)) {
-        perror("fclose");
+    if (close(fd) == -1) {
+        perror("close");
         exit(1);
     }
 
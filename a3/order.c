@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "helper.h"
+
+/* Every supported -k spec gets its own comparator and stable merge sort,
+ * generated here at compile time, so no spec is interpreted per
+ * comparison and the comparator can be inlined into its merge sort.
+ */
+
+#define FREQ_ASC(a, b) (((a)->freq > (b)->freq) - ((a)->freq < (b)->freq))
+#define FREQ_DESC(a, b) FREQ_ASC(b, a)
+#define WORD_ASC(a, b) strncmp((a)->word, (b)->word, SIZE)
+#define WORD_DESC(a, b) WORD_ASC(b, a)
+#define NONE(a, b) 0
+
+#define DEFINE_CMP(name, FIRST, SECOND)                                 \
+    static int name(const void *p1, const void *p2) {                  \
+        const struct rec *a = p1, *b = p2;                              \
+        int c = FIRST(a, b);                                            \
+        return c != 0 ? c : SECOND(a, b);                               \
+    }
+
+/* Below this many records a run is sorted by insertion. */
+#define MSORT_RUN 16
+
+/* Stable bottom-up merge sort of recs by cmp, using tmp (room for n
+ * records) as scratch. Always inlined, so each instance below calls its
+ * comparator directly.
+ */
+static inline __attribute__((always_inline))
+void merge_sort(struct rec *recs, long n, struct rec *tmp,
+                int (*cmp)(const void *, const void *)) {
+    for (long lo = 0; lo < n; lo += MSORT_RUN) {
+        long hi = lo + MSORT_RUN < n ? lo + MSORT_RUN : n;
+        for (long i = lo + 1; i < hi; i++) {
+            struct rec r = recs[i];
+            long j = i;
+            for (; j > lo && cmp(&recs[j - 1], &r) > 0; j--) {
+                recs[j] = recs[j - 1];
+            }
+            recs[j] = r;
+        }
+    }
+    struct rec *src = recs, *dst = tmp;
+    for (long width = MSORT_RUN; width < n; width *= 2) {
+        for (long lo = 0; lo < n; lo += 2 * width) {
+            long mid = lo + width < n ? lo + width : n;
+            long hi = lo + 2 * width < n ? lo + 2 * width : n;
+            long i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                // take from the right only when strictly smaller
+                dst[k++] = cmp(&src[j], &src[i]) < 0 ? src[j++] : src[i++];
+            }
+            while (i < mid) {
+                dst[k++] = src[i++];
+            }
+            while (j < hi) {
+                dst[k++] = src[j++];
+            }
+        }
+        struct rec *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != recs) {
+        memcpy(recs, src, n * sizeof(struct rec));
+    }
+}
+
+#define DEFINE_ORDER(name, FIRST, SECOND)                               \
+    DEFINE_CMP(cmp_##name, FIRST, SECOND)                               \
+    static void msort_##name(struct rec *recs, long n, struct rec *tmp) { \
+        merge_sort(recs, n, tmp, cmp_##name);                           \
+    }
+
+DEFINE_ORDER(freq_asc, FREQ_ASC, NONE)
+DEFINE_ORDER(freq_desc, FREQ_DESC, NONE)
+DEFINE_ORDER(freq_asc_word_asc, FREQ_ASC, WORD_ASC)
+DEFINE_ORDER(freq_asc_word_desc, FREQ_ASC, WORD_DESC)
+DEFINE_ORDER(freq_desc_word_asc, FREQ_DESC, WORD_ASC)
+DEFINE_ORDER(freq_desc_word_desc, FREQ_DESC, WORD_DESC)
+DEFINE_ORDER(word_asc, WORD_ASC, NONE)
+DEFINE_ORDER(word_desc, WORD_DESC, NONE)
+DEFINE_ORDER(word_asc_freq_asc, WORD_ASC, FREQ_ASC)
+DEFINE_ORDER(word_asc_freq_desc, WORD_ASC, FREQ_DESC)
+DEFINE_ORDER(word_desc_freq_asc, WORD_DESC, FREQ_ASC)
+DEFINE_ORDER(word_desc_freq_desc, WORD_DESC, FREQ_DESC)
+
+#define ORDER(name, spec) {spec, cmp_##name, msort_##name}
+
+static struct {
+    char *spec;
+    int (*cmp)(const void *, const void *);
+    void (*msort)(struct rec *, long, struct rec *);
+} orders[] = {
+    ORDER(freq_asc, "freq:asc"),
+    ORDER(freq_desc, "freq:desc"),
+    ORDER(freq_asc_word_asc, "freq:asc,word:asc"),
+    ORDER(freq_asc_word_desc, "freq:asc,word:desc"),
+    ORDER(freq_desc_word_asc, "freq:desc,word:asc"),
+    ORDER(freq_desc_word_desc, "freq:desc,word:desc"),
+    ORDER(word_asc, "word:asc"),
+    ORDER(word_desc, "word:desc"),
+    ORDER(word_asc_freq_asc, "word:asc,freq:asc"),
+    ORDER(word_asc_freq_desc, "word:asc,freq:desc"),
+    ORDER(word_desc_freq_asc, "word:desc,freq:asc"),
+    ORDER(word_desc_freq_desc, "word:desc,freq:desc"),
+};
+
+#define N_ORDERS (sizeof(orders) / sizeof(orders[0]))
+
+/* Return the key a canonical field such as word:desc names. */
+static enum sort_key field_key(char *field) {
+    int desc = strncmp(field + 4, ":desc", 5) == 0;
+    if (strncmp(field, "freq", 4) == 0) {
+        return desc ? KEY_FREQ_DESC : KEY_FREQ_ASC;
+    }
+    return desc ? KEY_WORD_DESC : KEY_WORD_ASC;
+}
+
+/* Return the table entry for spec, or -1 if it is not supported. */
+static int find_order(char *spec) {
+    for (int i = 0; i < N_ORDERS; i++) {
+        if (strcmp(spec, orders[i].spec) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Set *order from a -k spec: a comma separated list of freq and word,
+ * each optionally followed by :asc (the default) or :desc. The stable
+ * flag is left alone. Return 0 on success, -1 if the spec is not
+ * supported.
+ */
+int parse_order(char *spec, struct order *order) {
+    // spell the spec out in full, e.g. "freq,word:desc" becomes
+    // "freq:asc,word:desc", to look it up
+    char full[64] = "";
+    char copy[64];
+    strncpy(copy, spec, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    char *save;
+    for (char *field = strtok_r(copy, ",", &save); field != NULL;
+         field = strtok_r(NULL, ",", &save)) {
+        if (strlen(full) + strlen(field) + 6 >= sizeof(full)) {
+            return -1;
+        }
+        if (full[0] != '\0') {
+            strcat(full, ",");
+        }
+        strcat(full, field);
+        if (strchr(field, ':') == NULL) {
+            strcat(full, ":asc");
+        }
+    }
+    int i = find_order(full);
+    if (i == -1) {
+        return -1;
+    }
+    order->cmp = orders[i].cmp;
+    order->msort = orders[i].msort;
+    order->keys[0] = field_key(full);
+    order->keys[1] = strchr(full, ',') ? field_key(strchr(full, ',') + 1) : KEY_NONE;
+    order->by_freq = strncmp(full, "freq", 4) == 0;
+    order->desc = strncmp(full, "freq:desc", 9) == 0;
+    if (!order->by_freq) {
+        order->tie = order->cmp;
+        order->tie_msort = order->msort;
+    } else if (strchr(full, ',') != NULL) {
+        // freq leads, so what follows it is word:asc or word:desc
+        int t = find_order(strchr(full, ',') + 1);
+        order->tie = orders[t].cmp;
+        order->tie_msort = orders[t].msort;
+    } else {
+        order->tie = NULL;
+        order->tie_msort = NULL;
+    }
+    return 0;
+}
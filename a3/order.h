@@ -0,0 +1,66 @@
+#ifndef _ORDER_H
+#define _ORDER_H
+
+/* The records psort sorts and the options that say how, shared by psort
+ * and by programs that use libpsort.
+ */
+
+#define SIZE 44
+
+struct rec {
+    int freq;
+    char word[SIZE];
+};
+
+/* One key of a sort order, for code that compares records it does not
+ * hold as struct rec.
+ */
+enum sort_key {
+    KEY_NONE,
+    KEY_FREQ_ASC,
+    KEY_FREQ_DESC,
+    KEY_WORD_ASC,
+    KEY_WORD_DESC
+};
+
+/* The order psort sorts in, from a -k spec such as freq:desc,word:asc.
+ * When freq leads, the integer engines sort on rec_key() and tie breaks
+ * the records whose key is equal. When word leads, tie is the whole
+ * order. The comparators and merge sorts are generated per spec at
+ * compile time in order.c.
+ */
+struct order {
+    int by_freq;        // freq is the first key
+    int desc;           // ...and it is descending
+    int stable;         // records that compare equal keep their input order
+    int (*cmp)(const void *, const void *);         // the whole order
+    int (*tie)(const void *, const void *);         // NULL if keys are enough
+    void (*msort)(struct rec *, long, struct rec *);    // stable, by cmp
+    void (*tie_msort)(struct rec *, long, struct rec *);    // stable, by tie
+    enum sort_key keys[2];      // the spec itself, KEY_NONE if one key
+};
+
+int parse_order(char *spec, struct order *order);
+
+/* The sort engines a worker can use. SORT_AUTO picks one per call from
+ * the range of keys being sorted.
+ */
+enum sort_algo {
+    SORT_AUTO,
+    SORT_QSORT,
+    SORT_COUNTING,
+    SORT_RADIX,
+    SORT_MERGE
+};
+
+/* Settings shared by every psort backend. */
+struct psort_opts {
+    enum sort_algo algo;
+    int verbose;        // report every worker's sort on stderr
+    int threads;        // run workers as threads of one process, not forks
+    int index;          // sort (freq, index) pairs, then gather the records
+    struct order order;
+};
+
+int parse_algo(char *name, enum sort_algo *algo);
+#endif /* _ORDER_H */
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "helper.h"
+#include "pool.h"
+#include "cpu.h"
+
+/* A fixed pool of threads with work stealing.
+ * Every thread owns a contiguous block of task indices [head, tail) and
+ * runs them from the front. A thread whose block is empty steals the last
+ * task of the fullest remaining block, so threads that draw quick tasks
+ * keep helping the slow ones instead of going idle.
+ */
+
+struct deque {
+    pthread_mutex_t lock;
+    long head;
+    long tail;
+};
+
+struct pool {
+    int nthreads;
+    struct deque *queues;
+    void (*task)(long, void *);
+    void *arg;
+};
+
+struct worker {
+    struct pool *pool;
+    int id;
+};
+
+/* Take the next task from our own block, or -1 if it is empty. */
+static long take_own(struct deque *q) {
+    long t = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        t = q->head++;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return t;
+}
+
+/* Steal a task from the back of the fullest other block, or -1 when no
+ * work is left anywhere.
+ */
+static long steal(struct pool *pool, int self) {
+    while (1) {
+        int victim = -1;
+        long most = 0;
+        for (int i = 0; i < pool->nthreads; i++) {
+            // unlocked peek: only used to choose a victim
+            long left = pool->queues[i].tail - pool->queues[i].head;
+            if (i != self && left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim == -1) {
+            return -1;
+        }
+        struct deque *q = &pool->queues[victim];
+        long t = -1;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+            t = --q->tail;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (t != -1) {
+            return t;
+        }
+    }
+}
+
+static void *work(void *arg) {
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+    pin_worker(w->id);
+    long t;
+    while ((t = take_own(&pool->queues[w->id])) != -1 ||
+           (t = steal(pool, w->id)) != -1) {
+        pool->task(t, pool->arg);
+    }
+    return NULL;
+}
+
+/* Run task(i, arg) for every i in [0, ntasks) on nthreads threads and
+ * return once all of them are done. This never fails: short of memory or
+ * threads, fewer threads, down to the caller alone, run all the tasks.
+ */
+void pool_run(int nthreads, long ntasks, void (*task)(long, void *), void *arg) {
+    if (nthreads > ntasks) {
+        nthreads = ntasks > 0 ? ntasks : 1;
+    }
+    struct pool pool = {nthreads, NULL, task, arg};
+    pool.queues = malloc(nthreads * sizeof(struct deque));
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    struct worker *workers = malloc(nthreads * sizeof(struct worker));
+    if (pool.queues == NULL || threads == NULL || workers == NULL) {
+        free(workers);
+        free(threads);
+        free(pool.queues);
+        for (long t = 0; t < ntasks; t++) {
+            task(t, arg);
+        }
+        return;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+        pool.queues[i].head = ntasks * i / nthreads;
+        pool.queues[i].tail = ntasks * (i + 1) / nthreads;
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+    // the calling thread works as thread 0, pinned only while it does; the
+    // blocks of threads that could not be started are left to be stolen
+    int started = 1;
+    while (started < nthreads &&
+           pthread_create(&threads[started], NULL, work, &workers[started]) == 0) {
+        started++;
+    }
+    work(&workers[0]);
+    unpin_worker();
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(workers);
+    free(threads);
+    free(pool.queues);
+}
+
+/* The process counterpart of pool_run: run task(i, arg) for every i in
+ * [0, ntasks) in its own forked worker and wait for all of them. Whatever
+ * the tasks write must live in memory shared with the parent.
+ */
+void fork_run(long ntasks, void (*task)(long, void *), void *arg) {
+    for (long i = 0; i < ntasks; i++) {
+        int res = fork();
+        if (res < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (res == 0) {
+            pin_worker(i);
+            task(i, arg);
+            exit(0);
+        }
+    }
+    wait_workers(ntasks);
+}
+
+/* Run task(i, arg) for every i in [0, n), one worker per task: threads of
+ * this process if threads is set, forked processes otherwise.
+ */
+void run_workers(long n, int threads, void (*task)(long, void *), void *arg) {
+    if (threads) {
+        pool_run(n, n, task, arg);
+    } else {
+        fork_run(n, task, arg);
+    }
+}
@@ -0,0 +1,7 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+void pool_run(int nthreads, long ntasks, void (*task)(long, void *), void *arg);
+void fork_run(long ntasks, void (*task)(long, void *), void *arg);
+void run_workers(long n, int threads, void (*task)(long, void *), void *arg);
+#endif /* _POOL_H */
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "helper.h"
+#include "compact.h"
+#include "index.h"
+
+#define USAGE "Usage: pquery -f <sorted file> (-b <lo>,<hi> | -t <records>) [-c] [-v]\n"
+
+/* A sorted file and its index, both mapped. */
+struct sorted {
+    struct index_header *hdr;
+    struct index_block *blocks;
+    char *recs;             // the first record
+    size_t stride;          // bytes from one record to the next
+    char *pool;             // v2 only
+    long blocks_read;
+};
+
+/* Map filename read-only and return it, with its length in *len. */
+static void *map_file(char *filename, size_t *len) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror(filename);
+        exit(1);
+    }
+    struct stat sbuf;
+    if (fstat(fd, &sbuf) == -1) {
+        perror("fstat");
+        exit(1);
+    }
+    *len = sbuf.st_size;
+    void *base = NULL;
+    if (*len > 0 &&
+        (base = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    return base;
+}
+
+static int freq_of(struct sorted *s, long i) {
+    return *(int *) (s->recs + i * s->stride);
+}
+
+/* Print record i, or only count it if count is set. */
+static void emit(struct sorted *s, long i, int count) {
+    if (count) {
+        return;
+    }
+    if (s->pool != NULL) {
+        struct v2_rec *e = (struct v2_rec *) (s->recs + i * s->stride);
+        printf("%d %s\n", e->freq, s->pool + e->word);
+    } else {
+        struct rec *r = (struct rec *) (s->recs + i * s->stride);
+        printf("%d %.*s\n", r->freq, SIZE, r->word);
+    }
+}
+
+/* Return 1 if every record of block b comes before [lo, hi] in the
+ * file's order, and so before any match.
+ */
+static int block_before(struct sorted *s, long b, int lo, int hi) {
+    return s->hdr->desc ? s->blocks[b].min_freq > hi : s->blocks[b].max_freq < lo;
+}
+
+/* Print the records with freq in [lo, hi]; return how many there are. */
+static long between(struct sorted *s, int lo, int hi, int count) {
+    long first = 0, n_blocks = s->hdr->n_blocks;
+    if (s->hdr->by_freq) {
+        // the first block that is not wholly before the range
+        long l = 0, h = n_blocks;
+        while (l < h) {
+            long mid = l + (h - l) / 2;
+            if (block_before(s, mid, lo, hi)) {
+                l = mid + 1;
+            } else {
+                h = mid;
+            }
+        }
+        first = l;
+    }
+    long found = 0;
+    for (long b = first; b < n_blocks; b++) {
+        if (s->blocks[b].max_freq < lo || s->blocks[b].min_freq > hi) {
+            if (s->hdr->by_freq) {
+                break;  // every block after this one is past the range
+            }
+            continue;
+        }
+        s->blocks_read++;
+        long end = (b + 1) * s->hdr->block;
+        for (long i = b * s->hdr->block; i < end && i < s->hdr->count; i++) {
+            int freq = freq_of(s, i);
+            if (freq >= lo && freq <= hi) {
+                emit(s, i, count);
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+/* Print the n records with the highest freq, highest first. */
+static long top(struct sorted *s, long n, int count) {
+    if (n > s->hdr->count) {
+        n = s->hdr->count;
+    }
+    for (long k = 0; k < n; k++) {
+        emit(s, s->hdr->desc ? k : s->hdr->count - 1 - k, count);
+    }
+    s->blocks_read = (n + s->hdr->block - 1) / s->hdr->block;
+    return n;
+}
+
+/* Answer freq range and top-N queries on a file sorted by psort -x,
+ * reading only the blocks its sparse index says can hold matches.
+ * Matching records are printed one per line as freq and word.
+ */
+int main(int argc, char *argv[]) {
+    extern char *optarg;
+    int ch;
+    char *filename = NULL;
+    int lo = 0, hi = -1;
+    long n_top = -1;
+    int count = 0, verbose = 0;
+
+    while ((ch = getopt(argc, argv, "f:b:t:cv")) != -1) {
+        switch(ch) {
+        case 'f':
+            filename = optarg;
+            break;
+        case 'b':
+            // freq BETWEEN lo AND hi
+            if (sscanf(optarg, "%d,%d", &lo, &hi) != 2 || lo > hi) {
+                fprintf(stderr, "pquery: bad range %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            if ((n_top = strtol(optarg, NULL, 10)) < 0) {
+                fprintf(stderr, "pquery: bad record count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'c':
+            // print only how many records match
+            count = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (filename == NULL || (hi < lo) == (n_top < 0)) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+
+    char name[4096];
+    index_name(name, sizeof(name), filename);
+    size_t index_len, len;
+    struct sorted s;
+    s.hdr = map_file(name, &index_len);
+    if (s.hdr == NULL || index_len < sizeof(struct index_header) ||
+        memcmp(s.hdr->magic, INDEX_MAGIC, 4) != 0 ||
+        index_len != sizeof(struct index_header) +
+                     s.hdr->n_blocks * sizeof(struct index_block)) {
+        fprintf(stderr, "pquery: %s is not a psort index\n", name);
+        exit(1);
+    }
+    s.blocks = (struct index_block *) (s.hdr + 1);
+    s.blocks_read = 0;
+    long n = s.hdr->compact ? compact_count(filename)
+                            : (long) (get_file_size(filename) / sizeof(struct rec));
+    if (n != s.hdr->count) {
+        fprintf(stderr, "pquery: %s does not match its index\n", filename);
+        exit(1);
+    }
+    char *base = map_file(filename, &len);
+    s.recs = base;
+    s.stride = sizeof(struct rec);
+    s.pool = NULL;
+    if (s.hdr->compact) {
+        s.recs = base + sizeof(struct v2_header);
+        s.stride = sizeof(struct v2_rec);
+        s.pool = s.recs + n * sizeof(struct v2_rec);
+    }
+
+    long found;
+    if (n_top >= 0) {
+        if (!s.hdr->by_freq) {
+            fprintf(stderr, "pquery: top records need a file sorted by freq\n");
+            exit(1);
+        }
+        found = top(&s, n_top, count);
+    } else {
+        found = between(&s, lo, hi, count);
+    }
+    if (count) {
+        printf("%ld\n", found);
+    }
+    if (verbose) {
+        fprintf(stderr, "pquery: %ld records from %ld of %ld blocks\n", found,
+                s.blocks_read, s.hdr->n_blocks);
+    }
+    if (base != NULL) {
+        munmap(base, len);
+    }
+    munmap(s.hdr, index_len);
+    return 0;
+}
@@ -2,137 +2,530 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <getopt.h>
 #include "helper.h"
+#include "extsort.h"
+#include "samplesort.h"
+#include "topk.h"
+#include "stats.h"
+#include "compact.h"
+#include "index.h"
+#include "update.h"
+#include "group.h"
+#include "stream.h"
+#include "aio.h"
+#include "cpu.h"
+#include "engine.h"
+#include "libpsort.h"
 
-int main(int argc, char *argv[]) {
+#define USAGE "Usage: psort -n <number of processes | auto> -f <input file name | -> " \
+              "-o <output file name | -> [-z | -t] [-S | -m <memory budget>]\n" \
+              "             [-u <sorted file> [<more input files>]]\n" \
+              "             [-k <sort keys>] [-s] [-a auto|qsort|counting|radix|merge]\n" \
+              "             [-i] [-g] [-K <records>] [-x] [-P] [-v]\n" \
+              "             [--stats[=text|json]]\n"
 
-    if (argc != 7) {
-        fprintf(stderr, "Usage: psort -n <number of processes> -f <inputfile> -o <outputfile>\n");
+/* Write a sorted run back to the parent, one record at a time so the
+ * parent can merge it with plain fixed-size reads.
+ */
+void send_run(int fd, struct rec *recs, long count) {
+    for (long i = 0; i < count; i++){
+        if (write(fd, &(recs[i]), sizeof(struct rec)) == -1){
+            perror("write");
+            exit(1);
+        }
+    }
+    if (close(fd) == -1) {
+        perror("close");
         exit(1);
     }
-    int n_process;
-    extern char *optarg;
-    int ch;
-    char *input_file, *output_file;
-    while ((ch = getopt(argc, argv, "n:f:o:")) != -1) {
-        switch(ch) {
-  	        case 'n':
-  	        n_process = strtol(optarg, NULL, 10);
-  	        break;	    
-            case 'f':
-  	        input_file = optarg;
-  	        break;
-  	        case 'o':
-      	    output_file = optarg;
-      	    break;
-         	default:
-                  fprintf(stderr, "Usage: psort -n <number of processses> "
-      		"-f <input file name> -o <output file name>\n");
-      	    exit(1);
-  	    }
-    }
-    FILE* fp = fopen(input_file, "rb");
+}
+
+/* Sort without pipes: each worker copies its slice of the input into a
+ * region shared with the parent and sorts it there. A second round of
+ * workers then merges the sorted slices directly into the mapped output
+ * file, each one writing the output range it co-ranks to. The output is
+ * only created once the input has been copied, so it may be the input.
+ */
+void sort_shared(char *input_file, char *output_file, long size, int n_process,
+                 struct psort_opts *opts) {
+    if (size == 0) {
+        map_output(output_file, 0);
+        return;
+    }
+    struct rec *shared = alloc_shared(size * sizeof(struct rec));
+    struct run runs[n_process];
+    stats_tasks(n_process);
+    stats_phase(PHASE_SORT);
+    for (int pid = 0; pid < n_process; pid++){
+        runs[pid].recs = shared + part_start(pid, size, n_process);
+        runs[pid].n = part_size(pid, size, n_process);
+        int res = fork();
+        if(res < 0){
+            perror("fork");
+            exit(1);
+        }
+        if(res == 0){
+            pin_worker(pid);
+            if (runs[pid].n > 0) {
+                void *base;
+                size_t len;
+                struct rec *recs = map_part(input_file,
+                    part_start(pid, size, n_process), runs[pid].n, &base, &len);
+                if (worker_sort(pid, recs, runs[pid].n, runs[pid].recs, opts) == -1) {
+                    exit(1);
+                }
+                munmap(base, len);
+            }
+            exit(0);
+        }
+    }
+    wait_workers(n_process);
+    stats_phase(PHASE_MERGE);
+    struct rec *out = map_output(output_file, size);
+    // merge in parallel too: each worker writes its own slice of the output
+    for (int pid = 0; pid < n_process; pid++){
+        int res = fork();
+        if(res < 0){
+            perror("fork");
+            exit(1);
+        }
+        if(res == 0){
+            pin_worker(pid);
+            long lo = part_start(pid, size, n_process);
+            if (merge_slice(runs, n_process, lo, lo + part_size(pid, size, n_process),
+                            out, &opts->order) == -1) {
+                exit(1);
+            }
+            exit(0);
+        }
+    }
+    wait_workers(n_process);
+    stats_phase(PHASE_WRITE);
+    munmap(shared, size * sizeof(struct rec));
+    if (munmap(out, size * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+}
+
+/* Sort with a pool of n_threads threads instead of forked workers. The
+ * whole input is mapped once, privately, and sorted by libpsort's engine
+ * straight into the mapped output file.
+ */
+void sort_threads(char *input_file, char *output_file, long size, int n_threads,
+                  struct psort_opts *opts) {
+    if (size == 0) {
+        map_output(output_file, 0);
+        return;
+    }
+    // the private mapping still reads from the file, so sorting a file
+    // onto itself goes through a temporary output
+    char *name = output_name(input_file, output_file);
+    struct rec *out = map_output(name, size);
+    void *base;
+    size_t len;
+    stats_phase(PHASE_READ);
+    struct rec *recs = map_part(input_file, 0, size, &base, &len);
+    if (sort_buffer(recs, size, out, n_threads, opts) == -1) {
+        exit(1);
+    }
+    stats_phase(PHASE_WRITE);
+    munmap(base, len);
+    if (munmap(out, size * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+    finish_output(name, output_file);
+}
+
+/* The original backend: the parent reads the input and feeds each forked
+ * worker its slice through a pipe, then merges the sorted runs the
+ * workers send back through a second pipe into the output file.
+ */
+void sort_pipes(char *input_file, char *output_file, long size, int n_process,
+                struct psort_opts *opts) {
+    FILE *fp = fopen(input_file, "rb");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    // data_fd carries a worker's share of the input, pipe_fd brings the
+    // sorted run back; sharing one pipe both ways lets the parent's merge
+    // steal input the worker has not read yet
+    int data_fd[n_process][2];
     int pipe_fd[n_process][2];
-    int size = get_file_size(input_file)/sizeof(struct rec);
     int status;
-    int large_process_size = size/n_process +1;
-    int small_process_size = size/n_process;
-    
+
+    stats_tasks(n_process);
+    stats_phase(PHASE_READ);
     for (int pid = 0; pid < n_process; pid++){
-    	pipe(pipe_fd[pid]);
-      	int res = fork();
-      	if(res < 0){
-          	perror("fork");
-          	exit(1);
-        }
-      	int p_size;
-      	if(pid < size % n_process){
-      		  p_size = large_process_size;
-      	}else{
-      		  p_size = small_process_size;
-      	}
-      	if(res > 0){
-    		for (int k = 0; k < p_size; k++){
-          	struct rec record;
-    		fread(&record, sizeof(struct rec), 1, fp);
-          	write(pipe_fd[pid][1], &record, sizeof(struct rec));
-    		}
-    		if (close(pipe_fd[pid][1]) == -1) {
-    		    perror("close");
-    		    exit(1);
-    	  	}
-        }
-      	if(res == 0){
-        fclose(fp);
-    		struct rec recs[p_size];
-    		for (int j = 0; j < pid; j++)
-    		{
-    			if (close(pipe_fd[j][0]) == -1) {
-          		perror("close");
-          		exit(1);
-          		}
-    		}
-    		for (int i = 0; i < p_size; i++){
-    			 read(pipe_fd[pid][0], &(recs[i]), sizeof(struct rec));
-    		}
-    		if (close(pipe_fd[pid][0]) == -1) {
-          		perror("close");
-          		exit(1);
-    			}
-    		qsort(recs, p_size, sizeof(struct rec), compare_freq);
-    		for (int i = 0; i < p_size; i++){
-      			if (write(pipe_fd[pid][1], &(recs[i]), sizeof(struct rec)) == -1){
-        				perror("write");
-        				exit(1);
-      			}
-    		}
-    		if (close(pipe_fd[pid][1]) == -1) {
-          		perror("close");
-          		exit(1);
-        	}
-        	exit(0);
+        if (pipe(data_fd[pid]) == -1 || pipe(pipe_fd[pid]) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        int res = fork();
+        if(res < 0){
+            perror("fork");
+            exit(1);
+        }
+        long p_size = part_size(pid, size, n_process);
+        if(res > 0){
+            if (close(pipe_fd[pid][1]) == -1 || close(data_fd[pid][0]) == -1) {
+                perror("close");
+                exit(1);
+            }
+            for (int k = 0; k < p_size; k++){
+                struct rec record;
+                fread(&record, sizeof(struct rec), 1, fp);
+                write(data_fd[pid][1], &record, sizeof(struct rec));
+            }
+            if (close(data_fd[pid][1]) == -1) {
+                perror("close");
+                exit(1);
+            }
+        }
+        if(res == 0){
+            pin_worker(pid);
+            for (int j = 0; j < pid; j++)
+            {
+                if (close(pipe_fd[j][0]) == -1) {
+                    perror("close");
+                    exit(1);
+                }
+            }
+            if (close(pipe_fd[pid][0]) == -1) {
+                perror("close");
+                exit(1);
+            }
+            fclose(fp);
+            struct rec *recs = malloc(p_size * sizeof(struct rec));
+            if (recs == NULL && p_size > 0) {
+                perror("malloc");
+                exit(1);
+            }
+            if (close(data_fd[pid][1]) == -1) {
+                perror("close");
+                exit(1);
+            }
+            for (int i = 0; i < p_size; i++){
+                read(data_fd[pid][0], &(recs[i]), sizeof(struct rec));
+            }
+            if (close(data_fd[pid][0]) == -1) {
+                perror("close");
+                exit(1);
+            }
+            if (worker_sort(pid, recs, p_size, recs, opts) == -1) {
+                exit(1);
+            }
+            send_run(pipe_fd[pid][1], recs, p_size);
+            exit(0);
         }
     }
     fclose(fp);
-    struct rec res[size];
+    // the workers sort while the parent still feeds the later ones, and
+    // the merge then waits for each run's first record
+    stats_phase(PHASE_MERGE);
+    // the merged output is written behind the merge
+    int ofd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ofd == -1) {
+        perror("open");
+        exit(1);
+    }
+    struct writer out;
+    writer_open(&out, ofd, MERGE_BUF);
     struct rec to_merge[n_process];
+    int runs[n_process];
+    int live = 0;
     for (int i = 0; i < n_process; i++){
-        if (wait(&status) == -1) {
-            perror("wait");
+        int read_res = read(pipe_fd[i][0], &(to_merge[i]), sizeof(struct rec));
+        if (read_res == -1){
+            perror("read");
             exit(1);
         }
-    }
-    for (int i = 0; i < n_process; i++){
-        if (read(pipe_fd[i][0], &(to_merge[i]), sizeof(struct rec)) == -1){
-        	perror("read");
-          	exit(1);
+        // a worker with nothing to sort sends back an empty run
+        if (read_res > 0){
+            runs[live++] = i;
         }
     }
-    for (int i = 0; i < size; i++){
-        int min_index = min(to_merge, n_process);
-        res[i] = to_merge[min_index];
+    struct merge_heap heap;
+    heap_init(&heap, to_merge, runs, live, &opts->order);
+    for (long i = 0; i < size; i++){
+        int min_index = heap_top(&heap);
+        writer_put(&out, &(to_merge[min_index]), sizeof(struct rec));
         int read_res = read(pipe_fd[min_index][0], &(to_merge[min_index]), sizeof(struct rec));
         if(read_res == -1){
             perror("read");
-            exit(1);}
-        if (read_res == 0)
-        {
-        	  to_merge[min_index].freq = -1;
-        } 
+            exit(1);
+        }
+        if (read_res == 0){
+            heap_pop(&heap);
+        }else{
+            heap_advance(&heap);
+        }
     }
+    stats_phase(PHASE_WRITE);
     for (int i = 0; i < n_process; i++)
     {
-    	if (close(pipe_fd[i][0]) == -1) {
+        if (close(pipe_fd[i][0]) == -1) {
             perror("close");
             exit(1);
         }
     }
-    FILE *ofp = fopen(output_file, "w");
-    for (int i = 0; i < size; i++){
-      	if (fwrite(&(res[i]), sizeof(struct rec), 1, ofp) == 0) {
-      	    perror("fwrite");
-      	    exit(1);}
+    // reap the workers only after their pipes are drained; a worker
+    // blocks on a full pipe until the merge reads its run
+    for (int i = 0; i < n_process; i++){
+        if (wait(&status) == -1) {
+            perror("wait");
+            exit(1);
+        }
+    }
+    writer_close(&out);
+    if (close(ofd) == -1) {
+        perror("close");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int n_process = 0;
+    int auto_n = 0;
+    int pin = 0;
+    extern char *optarg;
+    int ch;
+    char *input_file = NULL, *output_file = NULL;
+    int zero_copy = 0;
+    int sample = 0;
+    long top = 0;
+    int index = 0;
+    char *update = NULL;
+    int group = 0;
+    size_t budget = 0;
+    struct psort_opts opts;
+    psort_defaults(&opts);
+    int stable = 0;
+    int stats = 0;
+    enum stats_format stats_format = STATS_TEXT;
+    static struct option long_opts[] = {
+        {"stats", optional_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}
+    };
+    while ((ch = getopt_long(argc, argv, "n:f:o:ztSm:k:sa:igK:xu:Pv", long_opts,
+                             NULL)) != -1) {
+        switch(ch) {
+        case 'n':
+            // auto sizes the workers to the CPUs and the input
+            auto_n = strcmp(optarg, "auto") == 0;
+            n_process = auto_n ? 1 : strtol(optarg, NULL, 10);
+            break;
+        case 'f':
+            input_file = optarg;
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case 'z':
+            // workers map their own slice of the input file and hand
+            // back their runs through shared memory instead of pipes
+            zero_copy = 1;
+            break;
+        case 't':
+            // -n threads in one process sort slices of one shared buffer
+            opts.threads = 1;
+            break;
+        case 'S':
+            // range-partition by sampled splitters instead of merging
+            sample = 1;
+            break;
+        case 'm':
+            // sort out of core, holding at most this many bytes of records
+            if ((budget = parse_size(optarg)) == 0) {
+                fprintf(stderr, "psort: bad memory budget %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            // e.g. freq:desc,word:asc
+            if (parse_order(optarg, &opts.order) == -1) {
+                fprintf(stderr, "psort: unsupported sort keys %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            // records with equal keys keep their input order
+            stable = 1;
+            break;
+        case 'a':
+            if (parse_algo(optarg, &opts.algo) == -1) {
+                fprintf(stderr, "psort: unknown sort engine %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'i':
+            // sort compact (freq, index) keys and move each record once
+            opts.index = 1;
+            break;
+        case 'g':
+            // one record per word, its freq the sum of the word's records
+            group = 1;
+            break;
+        case 'K':
+            // write only the first records of the order, e.g. with
+            // -k freq:desc the most frequent words
+            if ((top = strtol(optarg, NULL, 10)) <= 0) {
+                fprintf(stderr, "psort: bad record count %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'x':
+            // write a sparse index of the output for pquery
+            index = 1;
+            break;
+        case 'u':
+            // merge the sorted input file into this sorted file
+            update = optarg;
+            break;
+        case 'P':
+            // pin every worker to its own CPU, filling one NUMA node
+            // after another
+            pin = 1;
+            break;
+        case 'v':
+            opts.verbose = 1;
+            break;
+        case 'T':
+            // time every phase and worker, and report on stdout at the end
+            if (parse_stats(optarg, &stats_format) == -1) {
+                fprintf(stderr, "psort: unknown stats format %s\n", optarg);
+                exit(1);
+            }
+            stats = 1;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (n_process <= 0 || input_file == NULL || output_file == NULL ||
+        (optind < argc && update == NULL)) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    opts.order.stable = stable;
+    // -g, -K, -m, -S and -u each pick a mode, and -z and -t a backend for
+    // the default one; say so rather than let one silently win
+    int n_modes = group + (top > 0) + (budget > 0) + sample + (update != NULL);
+    const char *conflict = NULL;
+    if (n_modes > 1) {
+        conflict = "only one of -g, -K, -m, -S and -u can be given";
+    } else if (zero_copy && (opts.threads || n_modes > 0)) {
+        conflict = "-z cannot be combined with -g, -K, -m, -S, -t or -u";
+    } else if (opts.threads && budget > 0) {
+        conflict = "-t cannot be combined with -m";
+    }
+    if (conflict != NULL) {
+        fprintf(stderr, "psort: %s\n", conflict);
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    // stdin and FIFOs are read in batches until they end, and v2 files
+    // are recognised by their header and sorted as they are
+    int streamed = is_stream(input_file);
+    long size = streamed ? 0 : compact_count(input_file);
+    int compact = !streamed && size != -1;
+    if (streamed) {
+        if (n_modes > 0 || zero_copy) {
+            fprintf(stderr, "psort: -g, -K, -m, -S, -u and -z need an input file\n");
+            exit(1);
+        }
+    } else if (!compact) {
+        size = get_file_size(input_file) / sizeof(struct rec);
+    } else if (n_modes > 0 || zero_copy) {
+        fprintf(stderr, "psort: -g, -K, -m, -S, -u and -z need 48-byte records\n");
+        exit(1);
+    }
+    // only a streamed sort writes to stdout; a FIFO also takes the output
+    // of -m and of the pipes backend, which write it in order
+    if (is_stream_output(output_file)) {
+        int in_order = streamed || (!compact && (budget > 0 ||
+                       (n_modes == 0 && !zero_copy && !opts.threads)));
+        int to_stdout = strcmp(output_file, "-") == 0;
+        conflict = to_stdout && !streamed ? "-o - needs a streamed input" :
+                   !in_order ? "a FIFO output needs a streamed input, -m or "
+                               "the default backend" :
+                   index ? "-x needs a regular output file" :
+                   stats && to_stdout ?
+                   "--stats reports on stdout, so it cannot go with -o -" : NULL;
+        if (conflict != NULL) {
+            fprintf(stderr, "psort: %s\n", conflict);
+            exit(1);
+        }
+    }
+    // with -u the input file and any more arguments are the deltas
+    int n_deltas = argc - optind + 1;
+    char *deltas[n_deltas];
+    deltas[0] = input_file;
+    memcpy(deltas + 1, argv + optind, (n_deltas - 1) * sizeof(char *));
+    if (update) {
+        // the output is created before the base and deltas are read
+        if (same_file(update, output_file)) {
+            fprintf(stderr, "psort: -u needs a new output file\n");
+            exit(1);
+        }
+        size = get_file_size(update) / sizeof(struct rec);
+        for (int d = 0; d < n_deltas; d++) {
+            if (same_file(deltas[d], output_file)) {
+                fprintf(stderr, "psort: -u needs a new output file\n");
+                exit(1);
+            }
+            size += get_file_size(deltas[d]) / sizeof(struct rec);
+        }
+    }
+    if (auto_n) {
+        n_process = auto_workers(streamed ? -1 : size);
+        if (opts.verbose) {
+            fprintf(stderr, "psort: %d workers\n", n_process);
+        }
+    }
+    if (pin) {
+        pin_init();
+    }
+    const char *mode = streamed ? "stream" : compact ? "compact" :
+                       group ? "group" : update ? "update" :
+                       top > 0 ? "topk" : budget > 0 ? "external" :
+                       sample ? "sample" : opts.threads ? "threads" :
+                       zero_copy ? "shared" : "pipes";
+    if (stats) {
+        stats_start(stats_format, mode, n_process, size);
+    }
+    if (streamed) {
+        stats_records(sort_stream(input_file, output_file, n_process, &opts));
+    } else if (compact) {
+        sort_compact(input_file, output_file, n_process, &opts);
+    } else if (group) {
+        sort_grouped(input_file, output_file, size, n_process, &opts);
+    } else if (update) {
+        sort_update(update, deltas, n_deltas, output_file, n_process, &opts);
+    } else if (top > 0) {
+        sort_topk(input_file, output_file, size, n_process, top, &opts);
+    } else if (budget > 0) {
+        sort_external(input_file, output_file, size, n_process, budget, &opts);
+    } else if (sample) {
+        sort_sample(input_file, output_file, size, n_process, &opts);
+    } else if (opts.threads) {
+        sort_threads(input_file, output_file, size, n_process, &opts);
+    } else if (zero_copy) {
+        sort_shared(input_file, output_file, size, n_process, &opts);
+    } else {
+        sort_pipes(input_file, output_file, size, n_process, &opts);
+    }
+    if (index) {
+        stats_phase(PHASE_WRITE);
+        write_index(output_file, &opts.order);
     }
-    fclose(ofp);
+    stats_report();
     return 0;
 }
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "pool.h"
+#include "samplesort.h"
+#include "stats.h"
+
+/* Sample sort: instead of merging sorted slices, sample the keys, choose
+ * n - 1 splitters and route every record to the bucket that owns its key
+ * range. Bucket b is then sorted in place as one contiguous piece of the
+ * output file, so there is no merge at all.
+ *
+ * The work is done in three rounds of n workers: count how many records
+ * of each input slice go to each bucket, scatter the records to their
+ * bucket's place in the output, then sort every bucket.
+ */
+
+struct sample_sort {
+    struct rec *in;
+    struct rec *out;
+    long size;
+    int n;
+    struct rec *splitters;  // n - 1 records, in sort order
+    long *count;        // count[w * n + b]: records slice w sends to bucket b
+    long *offset;       // where slice w's records for bucket b start in out
+    long *bucket;       // bucket b is out[bucket[b], bucket[b + 1])
+    struct psort_opts *opts;
+};
+
+/* Return the bucket record i goes to. Bucket b holds the keys between
+ * splitters b - 1 and b. A key equal to one or more splitters may go to
+ * any bucket those splitters border, so a heavily duplicated key is
+ * spread over them by position in the input rather than piling into one.
+ * Spreading by position keeps equal records in input order.
+ */
+static int route(struct sample_sort *ss, long i) {
+    const struct order *order = &ss->opts->order;
+    struct rec *r = &ss->in[i];
+    int lo = 0, hi = ss->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (order_cmp(order, &ss->splitters[mid], r) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int first = lo;
+    hi = ss->n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (order_cmp(order, &ss->splitters[mid], r) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (first == lo) {
+        return first;
+    }
+    return first + i * (lo - first + 1) / ss->size;
+}
+
+static void count_task(long w, void *arg) {
+    struct sample_sort *ss = arg;
+    long first = part_start(w, ss->size, ss->n);
+    long last = first + part_size(w, ss->size, ss->n);
+    long *count = ss->count + w * ss->n;
+    for (long i = first; i < last; i++) {
+        count[route(ss, i)]++;
+    }
+}
+
+static void scatter_task(long w, void *arg) {
+    struct sample_sort *ss = arg;
+    long first = part_start(w, ss->size, ss->n);
+    long last = first + part_size(w, ss->size, ss->n);
+    long *pos = ss->offset + w * ss->n;
+    for (long i = first; i < last; i++) {
+        ss->out[pos[route(ss, i)]++] = ss->in[i];
+    }
+}
+
+static void bucket_task(long b, void *arg) {
+    struct sample_sort *ss = arg;
+    struct rec *recs = ss->out + ss->bucket[b];
+    if (worker_sort(b, recs, ss->bucket[b + 1] - ss->bucket[b], recs, ss->opts) == -1) {
+        exit(1);
+    }
+}
+
+/* Pick n - 1 splitters from a seeded random sample of the records. */
+static void pick_splitters(struct sample_sort *ss) {
+    long n_samples = (long) ss->n * OVERSAMPLE;
+    if (n_samples > ss->size) {
+        n_samples = ss->size;
+    }
+    struct rec *keys = malloc(n_samples * sizeof(struct rec));
+    if (keys == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned short seed[3] = {0x5eed, 0x5eed, 0x5eed};
+    for (long i = 0; i < n_samples; i++) {
+        keys[i] = ss->in[(long) (erand48(seed) * ss->size)];
+    }
+    qsort(keys, n_samples, sizeof(struct rec), ss->opts->order.cmp);
+    for (int b = 0; b < ss->n - 1; b++) {
+        ss->splitters[b] = keys[(b + 1) * n_samples / ss->n];
+    }
+    free(keys);
+}
+
+void sort_sample(char *input_file, char *output_file, long size, int n_workers,
+                 struct psort_opts *opts) {
+    if (size == 0) {
+        map_output(output_file, 0);
+        return;
+    }
+    // records are scattered straight from the input, so a file sorted
+    // onto itself goes through a temporary output
+    char *name = output_name(input_file, output_file);
+    struct rec *out = map_output(name, size);
+    void *base;
+    size_t len;
+    struct sample_sort ss;
+    stats_phase(PHASE_READ);
+    ss.in = map_part(input_file, 0, size, &base, &len);
+    ss.out = out;
+    ss.size = size;
+    ss.n = n_workers;
+    ss.opts = opts;
+    ss.splitters = malloc(n_workers * sizeof(struct rec));
+    ss.offset = malloc((long) n_workers * n_workers * sizeof(long));
+    ss.bucket = malloc((n_workers + 1) * sizeof(long));
+    // forked workers report their counts through shared memory
+    ss.count = alloc_shared((long) n_workers * n_workers * sizeof(long));
+    if (ss.splitters == NULL || ss.offset == NULL || ss.bucket == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    stats_phase(PHASE_PARTITION);
+    pick_splitters(&ss);
+    run_workers(n_workers, opts->threads, count_task, &ss);
+
+    // lay the buckets out in order, and each slice's share of a bucket
+    // after the shares of the slices before it
+    long pos = 0;
+    for (int b = 0; b < n_workers; b++) {
+        ss.bucket[b] = pos;
+        for (int w = 0; w < n_workers; w++) {
+            ss.offset[w * n_workers + b] = pos;
+            pos += ss.count[w * n_workers + b];
+        }
+    }
+    ss.bucket[n_workers] = pos;
+
+    run_workers(n_workers, opts->threads, scatter_task, &ss);
+    stats_tasks(n_workers);
+    stats_phase(PHASE_SORT);
+    run_workers(n_workers, opts->threads, bucket_task, &ss);
+    stats_phase(PHASE_WRITE);
+
+    munmap(ss.count, (long) n_workers * n_workers * sizeof(long));
+    free(ss.bucket);
+    free(ss.offset);
+    free(ss.splitters);
+    munmap(base, len);
+    if (munmap(out, size * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+    finish_output(name, output_file);
+}
@@ -0,0 +1,11 @@
+#ifndef _SAMPLESORT_H
+#define _SAMPLESORT_H
+
+#include "helper.h"
+
+/* Splitters are picked from this many sampled keys per worker. */
+#define OVERSAMPLE 64
+
+void sort_sample(char *input_file, char *output_file, long size, int n_workers,
+                 struct psort_opts *opts);
+#endif /* _SAMPLESORT_H */
@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "helper.h"
+#include "stats.h"
+
+/* Instrumentation for --stats. The parent times every phase in wall and
+ * CPU time and counts the read and write syscalls made during it, from
+ * /proc/self/io. Workers record their sort in a slot of memory shared
+ * with the parent, so forked and threaded workers report the same way.
+ *
+ * The CPU time and I/O of a forked worker reach the parent only when it
+ * is reaped, so they count towards the phase that waits for it.
+ */
+
+static const char *phase_names[N_PHASES] = {
+    "read", "partition", "sort", "merge", "write"
+};
+
+/* A point in time, and the parent's resource use up to it. */
+struct sample {
+    struct timespec wall;
+    double cpu_ms;          // self and reaped workers, user and system
+    long syscr, syscw;      // read and write syscalls
+    long rchar, wchar;      // bytes they moved
+};
+
+struct phase_stats {
+    int used;
+    double wall_ms;
+    double cpu_ms;
+    long syscr, syscw;
+    long rchar, wchar;
+};
+
+struct task_stats {
+    long records;           // -1 if the slot was never filled
+    const char *engine;
+    int index;
+    double wall_ms;
+    double cpu_ms;
+};
+
+static struct {
+    int on;
+    enum stats_format format;
+    const char *mode;
+    int n_workers;
+    long size;
+    struct sample begin, mark;
+    enum phase current;     // N_PHASES between phases
+    struct phase_stats phases[N_PHASES];
+    struct task_stats *tasks;   // shared with forked workers
+    long n_tasks, cap;
+    pthread_mutex_t lock;       // held to fill a slot or move the slots
+} stats = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* Set *format from a --stats argument: text or json. Return 0 on
+ * success, -1 if the format is unknown.
+ */
+int parse_stats(char *name, enum stats_format *format) {
+    if (name == NULL || strcmp(name, "text") == 0) {
+        *format = STATS_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        *format = STATS_JSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static double ms_between(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e3 +
+           (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static double cpu_ms(struct rusage *ru) {
+    return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1e3 +
+           (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e3;
+}
+
+/* Fill s with the time now and what the parent has used so far. The
+ * syscall counts stay 0 where /proc is not mounted.
+ */
+static void take_sample(struct sample *s) {
+    // the one read() of /proc/self/io each sample makes is not psort's
+    static long own_calls, own_bytes;
+    memset(s, 0, sizeof(*s));
+    clock_gettime(CLOCK_MONOTONIC, &s->wall);
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    s->cpu_ms = cpu_ms(&self) + cpu_ms(&children);
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    char buf[512];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+    char name[32];
+    long value;
+    int used;
+    for (char *p = buf; sscanf(p, "%31[^:]: %ld\n%n", name, &value, &used) == 2;
+         p += used) {
+        if (strcmp(name, "syscr") == 0) {
+            s->syscr = value - own_calls;
+        } else if (strcmp(name, "syscw") == 0) {
+            s->syscw = value;
+        } else if (strcmp(name, "rchar") == 0) {
+            s->rchar = value - own_bytes;
+        } else if (strcmp(name, "wchar") == 0) {
+            s->wchar = value;
+        }
+    }
+    own_calls++;
+    own_bytes += len;
+}
+
+/* Turn stats on for a run of size records with n_workers workers, in
+ * the backend named mode. Until this is called every stats_ function
+ * does nothing.
+ */
+void stats_start(enum stats_format format, const char *mode, int n_workers,
+                 long size) {
+    stats.on = 1;
+    stats.format = format;
+    stats.mode = mode;
+    stats.n_workers = n_workers;
+    stats.size = size;
+    stats.current = N_PHASES;
+    take_sample(&stats.begin);
+}
+
+/* Set the record count once it is known, for streamed input. */
+void stats_records(long size) {
+    stats.size = size;
+}
+
+/* Make room for the reports of sort tasks [0, n_tasks), keeping those
+ * already made. A stream calls this again as every batch is queued,
+ * while threads may be reporting the batches before it.
+ */
+void stats_tasks(long n_tasks) {
+    if (!stats.on || n_tasks <= stats.n_tasks) {
+        return;
+    }
+    pthread_mutex_lock(&stats.lock);
+    if (n_tasks > stats.cap) {
+        long cap = n_tasks > 2 * stats.cap ? n_tasks : 2 * stats.cap;
+        struct task_stats *tasks = alloc_shared(cap * sizeof(struct task_stats));
+        for (long t = 0; t < cap; t++) {
+            tasks[t].records = -1;
+        }
+        if (stats.tasks != NULL) {
+            memcpy(tasks, stats.tasks, stats.n_tasks * sizeof(struct task_stats));
+            munmap(stats.tasks, stats.cap * sizeof(struct task_stats));
+        }
+        stats.tasks = tasks;
+        stats.cap = cap;
+    }
+    stats.n_tasks = n_tasks;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+/* End the current phase, if any, and start phase, if it is not
+ * N_PHASES. A phase entered twice adds up.
+ */
+void stats_phase(enum phase phase) {
+    if (!stats.on) {
+        return;
+    }
+    struct sample now;
+    take_sample(&now);
+    if (stats.current != N_PHASES) {
+        struct phase_stats *p = &stats.phases[stats.current];
+        p->used = 1;
+        p->wall_ms += ms_between(&stats.mark.wall, &now.wall);
+        p->cpu_ms += now.cpu_ms - stats.mark.cpu_ms;
+        p->syscr += now.syscr - stats.mark.syscr;
+        p->syscw += now.syscw - stats.mark.syscw;
+        p->rchar += now.rchar - stats.mark.rchar;
+        p->wchar += now.wchar - stats.mark.wchar;
+    }
+    stats.mark = now;
+    stats.current = phase;
+}
+
+/* Record that sort task id sorted n records with engine. Safe to call
+ * from any worker, forked or threaded, as each task has its own slot.
+ */
+void stats_task(long id, long n, const char *engine, int index, double wall_ms,
+                double cpu_ms) {
+    if (!stats.on) {
+        return;
+    }
+    pthread_mutex_lock(&stats.lock);
+    if (id >= 0 && id < stats.n_tasks) {
+        struct task_stats *t = &stats.tasks[id];
+        t->records = n;
+        t->engine = engine;
+        t->index = index;
+        t->wall_ms = wall_ms;
+        t->cpu_ms = cpu_ms;
+    }
+    pthread_mutex_unlock(&stats.lock);
+}
+
+/* The largest task over the mean, so 1.0 is a perfectly even split. */
+static double task_skew(void) {
+    long max = 0, total = 0, n = 0;
+    for (long t = 0; t < stats.n_tasks; t++) {
+        if (stats.tasks[t].records >= 0) {
+            total += stats.tasks[t].records;
+            max = stats.tasks[t].records > max ? stats.tasks[t].records : max;
+            n++;
+        }
+    }
+    return total == 0 ? 1.0 : (double) max * n / total;
+}
+
+static void report_text(struct sample *end, struct rusage *self,
+                        struct rusage *children) {
+    fprintf(stdout, "psort %s: %ld records, %d workers, %.3f ms wall, "
+            "%.3f ms cpu\n", stats.mode, stats.size, stats.n_workers,
+            ms_between(&stats.begin.wall, &end->wall),
+            end->cpu_ms - stats.begin.cpu_ms);
+    fprintf(stdout, "%-10s %12s %12s %10s %12s %10s %12s\n", "phase",
+            "wall ms", "cpu ms", "reads", "read bytes", "writes",
+            "write bytes");
+    for (int i = 0; i < N_PHASES; i++) {
+        struct phase_stats *p = &stats.phases[i];
+        if (p->used) {
+            fprintf(stdout, "%-10s %12.3f %12.3f %10ld %12ld %10ld %12ld\n",
+                    phase_names[i], p->wall_ms, p->cpu_ms, p->syscr, p->rchar,
+                    p->syscw, p->wchar);
+        }
+    }
+    if (stats.n_tasks > 0) {
+        fprintf(stdout, "%-10s %12s %12s %10s %s\n", "task", "wall ms",
+                "cpu ms", "records", "engine");
+        for (long t = 0; t < stats.n_tasks; t++) {
+            struct task_stats *ts = &stats.tasks[t];
+            if (ts->records >= 0) {
+                fprintf(stdout, "%-10ld %12.3f %12.3f %10ld %s%s\n", t,
+                        ts->wall_ms, ts->cpu_ms, ts->records, ts->engine,
+                        ts->index ? " of keys" : "");
+            }
+        }
+        fprintf(stdout, "task skew %.3f (largest task / mean)\n", task_skew());
+    }
+    fprintf(stdout, "peak rss %ld KB, largest worker %ld KB\n",
+            self->ru_maxrss, children->ru_maxrss);
+}
+
+static void report_json(struct sample *end, struct rusage *self,
+                        struct rusage *children) {
+    fprintf(stdout, "{\"mode\": \"%s\", \"records\": %ld, \"workers\": %d, "
+            "\"wall_ms\": %.3f, \"cpu_ms\": %.3f,\n", stats.mode, stats.size,
+            stats.n_workers, ms_between(&stats.begin.wall, &end->wall),
+            end->cpu_ms - stats.begin.cpu_ms);
+    fprintf(stdout, " \"phases\": [");
+    int first = 1;
+    for (int i = 0; i < N_PHASES; i++) {
+        struct phase_stats *p = &stats.phases[i];
+        if (p->used) {
+            fprintf(stdout, "%s\n  {\"name\": \"%s\", \"wall_ms\": %.3f, "
+                    "\"cpu_ms\": %.3f, \"read_calls\": %ld, \"read_bytes\": %ld, "
+                    "\"write_calls\": %ld, \"write_bytes\": %ld}",
+                    first ? "" : ",", phase_names[i], p->wall_ms, p->cpu_ms,
+                    p->syscr, p->rchar, p->syscw, p->wchar);
+            first = 0;
+        }
+    }
+    fprintf(stdout, "],\n \"tasks\": [");
+    first = 1;
+    for (long t = 0; t < stats.n_tasks; t++) {
+        struct task_stats *ts = &stats.tasks[t];
+        if (ts->records >= 0) {
+            fprintf(stdout, "%s\n  {\"id\": %ld, \"records\": %ld, "
+                    "\"engine\": \"%s\", \"index\": %s, \"wall_ms\": %.3f, "
+                    "\"cpu_ms\": %.3f}", first ? "" : ",", t, ts->records,
+                    ts->engine, ts->index ? "true" : "false", ts->wall_ms,
+                    ts->cpu_ms);
+            first = 0;
+        }
+    }
+    fprintf(stdout, "],\n \"task_skew\": %.3f, \"peak_rss_kb\": %ld, "
+            "\"worker_peak_rss_kb\": %ld}\n", task_skew(), self->ru_maxrss,
+            children->ru_maxrss);
+}
+
+/* End the current phase and print the report on stdout. */
+void stats_report(void) {
+    if (!stats.on) {
+        return;
+    }
+    stats_phase(N_PHASES);
+    struct sample end;
+    take_sample(&end);
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    if (stats.format == STATS_JSON) {
+        report_json(&end, &self, &children);
+    } else {
+        report_text(&end, &self, &children);
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/* The phases a psort run is timed in. A backend enters each phase it
+ * has with stats_phase(); phases it never enters are left out of the
+ * report.
+ */
+enum phase {
+    PHASE_READ,         // map or distribute the input
+    PHASE_PARTITION,    // sample splitters and route records to buckets
+    PHASE_SORT,         // sort the runs, or select the top records
+    PHASE_MERGE,        // merge the runs into the output
+    PHASE_WRITE,        // flush the output and reap the workers
+    N_PHASES
+};
+
+enum stats_format {
+    STATS_TEXT,
+    STATS_JSON
+};
+
+int parse_stats(char *name, enum stats_format *format);
+void stats_start(enum stats_format format, const char *mode, int n_workers,
+                 long size);
+void stats_records(long size);
+void stats_tasks(long n_tasks);
+void stats_phase(enum phase phase);
+void stats_task(long id, long n, const char *engine, int index, double wall_ms,
+                double cpu_ms);
+void stats_report(void);
+#endif /* _STATS_H */
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "helper.h"
+#include "cpu.h"
+#include "pool.h"
+#include "stats.h"
+#include "stream.h"
+
+/* Sort input whose size is not known up front: stdin (-f -), a FIFO or
+ * any other file that is not a regular one. The parent reads the input
+ * in batches and queues each one as it fills; n_threads threads sort
+ * the batches while the rest is still arriving. At the end of the input
+ * the sorted batches are merged into the output as co-ranked slices.
+ * Every record is held in memory until the merge.
+ */
+
+/* Return 1 if filename must be streamed: it is "-" or not a regular file. */
+int is_stream(char *filename) {
+    struct stat sbuf;
+    if (strcmp(filename, "-") == 0) {
+        return 1;
+    }
+    if (stat(filename, &sbuf) == -1) {
+        perror("stat");
+        exit(1);
+    }
+    return !S_ISREG(sbuf.st_mode);
+}
+
+/* Return 1 if filename cannot be mapped as output: it is "-", for
+ * stdout, or an existing file that is not a regular one, like a FIFO.
+ */
+int is_stream_output(char *filename) {
+    struct stat sbuf;
+    if (strcmp(filename, "-") == 0) {
+        return 1;
+    }
+    return stat(filename, &sbuf) == 0 && !S_ISREG(sbuf.st_mode);
+}
+
+/* Write the n records of recs to output_file, or stdout if it is "-",
+ * in order and with plain writes, as a pipe takes them.
+ */
+static void write_stream(char *output_file, struct rec *recs, long n) {
+    int fd = strcmp(output_file, "-") == 0 ? STDOUT_FILENO :
+             open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    char *p = (char *) recs;
+    size_t left = n * sizeof(struct rec);
+    while (left > 0) {
+        ssize_t w = write(fd, p, left);
+        if (w == -1) {
+            perror("write");
+            exit(1);
+        }
+        p += w;
+        left -= w;
+    }
+    if (fd != STDOUT_FILENO && close(fd) == -1) {
+        perror("close");
+        exit(1);
+    }
+}
+
+/* Read up to n records from fd into buf, retrying short reads as a pipe
+ * delivers them. Return the number of whole records read.
+ */
+static long read_batch(int fd, struct rec *buf, long n) {
+    char *p = (char *) buf;
+    size_t want = n * sizeof(struct rec), got = 0;
+    while (got < want) {
+        ssize_t r = read(fd, p + got, want - got);
+        if (r == -1) {
+            perror("read");
+            exit(1);
+        }
+        if (r == 0) {
+            break;
+        }
+        got += r;
+    }
+    if (got % sizeof(struct rec) != 0) {
+        fprintf(stderr, "psort: input ended in the middle of a record\n");
+        exit(1);
+    }
+    return got / sizeof(struct rec);
+}
+
+/* Sort batches as they are queued until the input ends and none is left. */
+static void *sort_batches(void *arg) {
+    struct stream *st = arg;
+    pthread_mutex_lock(&st->lock);
+    pin_worker(st->started++);
+    while (1) {
+        while (st->next == st->n_runs && !st->done) {
+            pthread_cond_wait(&st->ready, &st->lock);
+        }
+        if (st->next == st->n_runs) {
+            break;
+        }
+        long b = st->next++;
+        struct run run = st->runs[b];   // runs may move as it grows
+        pthread_mutex_unlock(&st->lock);
+        int err = worker_sort(b, run.recs, run.n, run.recs, st->opts);
+        pthread_mutex_lock(&st->lock);
+        if (err == -1) {
+            st->failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+static void merge_task(long t, void *arg) {
+    struct stream *st = arg;
+    long lo = part_start(t, st->size, st->n_threads);
+    if (merge_slice(st->runs, st->n_runs, lo, lo + part_size(t, st->size, st->n_threads),
+                    st->out, &st->opts->order) == -1) {
+        pthread_mutex_lock(&st->lock);
+        st->failed = 1;
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+/* Start n_threads threads sorting the batches queued on st, or as many
+ * as can be started. Return 0, or -1 if not even one could be.
+ */
+int stream_open(struct stream *st, int n_threads, struct psort_opts *opts) {
+    memset(st, 0, sizeof(*st));
+    st->n_threads = n_threads;
+    st->opts = opts;
+    st->threads = malloc(n_threads * sizeof(pthread_t));
+    if (st->threads == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->ready, NULL);
+    for (int i = 0; i < n_threads; i++) {
+        int err = pthread_create(&st->threads[i], NULL, sort_batches, st);
+        if (err != 0 && i == 0) {
+            fprintf(stderr, "pthread_create: error %d\n", err);
+            stream_close(st);
+            errno = err;
+            return -1;
+        }
+        if (err != 0) {
+            st->n_threads = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Queue the n records of batch, a malloc()ed buffer st then owns, to be
+ * sorted. Return 0, or -1 if memory ran out and the caller still owns
+ * batch.
+ */
+int stream_add(struct stream *st, struct rec *batch, long n) {
+    pthread_mutex_lock(&st->lock);
+    if (st->n_runs == st->cap) {
+        long cap = st->cap == 0 ? 16 : 2 * st->cap;
+        struct run *runs = realloc(st->runs, cap * sizeof(struct run));
+        if (runs == NULL) {
+            perror("realloc");
+            pthread_mutex_unlock(&st->lock);
+            return -1;
+        }
+        st->runs = runs;
+        st->cap = cap;
+    }
+    st->runs[st->n_runs].recs = batch;
+    st->runs[st->n_runs++].n = n;
+    st->size += n;
+    stats_tasks(st->n_runs);
+    pthread_cond_signal(&st->ready);
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+/* Mark the end of the input and wait until every batch is sorted. Return
+ * 0, or -1 if a batch could not be.
+ */
+int stream_finish(struct stream *st) {
+    pthread_mutex_lock(&st->lock);
+    st->done = 1;
+    pthread_cond_broadcast(&st->ready);
+    pthread_mutex_unlock(&st->lock);
+    for (int i = 0; i < st->n_threads; i++) {
+        pthread_join(st->threads[i], NULL);
+    }
+    return st->failed ? -1 : 0;
+}
+
+/* Merge the sorted batches into out, which holds st->size records.
+ * Return 0, or -1 if the merge ran out of memory.
+ */
+int stream_merge(struct stream *st, struct rec *out) {
+    st->out = out;
+    if (st->size > 0) {
+        pool_run(st->n_threads, st->n_threads, merge_task, st);
+    }
+    return st->failed ? -1 : 0;
+}
+
+/* Free the batches of a finished stream. */
+void stream_close(struct stream *st) {
+    for (long b = 0; b < st->n_runs; b++) {
+        free(st->runs[b].recs);
+    }
+    free(st->runs);
+    free(st->threads);
+    pthread_cond_destroy(&st->ready);
+    pthread_mutex_destroy(&st->lock);
+}
+
+/* Sort the streamed input_file into output_file and return the number
+ * of records. An output that cannot be mapped is merged in memory and
+ * then written out in order.
+ */
+long sort_stream(char *input_file, char *output_file, int n_threads,
+                 struct psort_opts *opts) {
+    int fd = strcmp(input_file, "-") == 0 ? STDIN_FILENO : open(input_file, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    struct stream st;
+    if (stream_open(&st, n_threads, opts) == -1) {
+        exit(1);
+    }
+
+    // read while the threads sort what has arrived
+    stats_phase(PHASE_READ);
+    while (1) {
+        struct rec *buf = malloc(STREAM_BATCH * sizeof(struct rec));
+        if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        long n = read_batch(fd, buf, STREAM_BATCH);
+        if (n == 0) {
+            free(buf);
+            break;
+        }
+        if (stream_add(&st, buf, n) == -1) {
+            exit(1);
+        }
+        if (n < STREAM_BATCH) {
+            break;
+        }
+    }
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+
+    stats_phase(PHASE_SORT);
+    if (stream_finish(&st) == -1) {
+        exit(1);
+    }
+    stats_phase(PHASE_MERGE);
+    int piped = is_stream_output(output_file);
+    struct rec *out = piped ? malloc(st.size * sizeof(struct rec)) :
+                      map_output(output_file, st.size);
+    if (piped && out == NULL && st.size > 0) {
+        perror("malloc");
+        exit(1);
+    }
+    if (stream_merge(&st, out) == -1) {
+        exit(1);
+    }
+
+    stats_phase(PHASE_WRITE);
+    long size = st.size;
+    stream_close(&st);
+    if (piped) {
+        write_stream(output_file, out, size);
+        free(out);
+    } else if (size > 0 && munmap(out, size * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+    return size;
+}
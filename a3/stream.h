@@ -0,0 +1,38 @@
+#ifndef _STREAM_H
+#define _STREAM_H
+
+#include <pthread.h>
+#include "helper.h"
+
+/* Streamed input is read and sorted in batches of this many records. */
+#define STREAM_BATCH (1L << 18)
+
+/* Batches of records sorted by a set of threads as they are queued, then
+ * merged once the input ends.
+ */
+struct stream {
+    struct run *runs;       // every batch queued so far
+    long n_runs, cap;
+    long next;              // the first batch no thread has taken yet
+    int done;               // the whole input has been queued
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t *threads;
+    int started;            // sorting threads that have taken their id
+    int failed;             // a batch or a merge slice ran out of memory
+    struct rec *out;
+    long size;
+    int n_threads;
+    struct psort_opts *opts;
+};
+
+int stream_open(struct stream *st, int n_threads, struct psort_opts *opts);
+int stream_add(struct stream *st, struct rec *batch, long n);
+int stream_finish(struct stream *st);
+int stream_merge(struct stream *st, struct rec *out);
+void stream_close(struct stream *st);
+int is_stream(char *filename);
+int is_stream_output(char *filename);
+long sort_stream(char *input_file, char *output_file, int n_threads,
+                 struct psort_opts *opts);
+#endif /* _STREAM_H */
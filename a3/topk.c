@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "pool.h"
+#include "topk.h"
+#include "stats.h"
+
+/* Top-K: write only the first k records of the sort order, e.g. the k
+ * most frequent words with -k freq:desc, without sorting everything.
+ * Each worker scans its slice once, keeping the best k records it has
+ * seen in a bounded heap, and hands them back sorted. The parent then
+ * merges just the first k records of those n sorted survivor runs.
+ */
+
+struct topk {
+    struct rec *in;
+    long size;
+    int n;
+    long k;
+    struct rec *kept;       // the records each worker keeps, shared with
+                            // the parent
+    long *offset;           // where each worker's block of kept starts
+    long *n_kept;           // how many of them each worker filled
+    struct psort_opts *opts;
+};
+
+/* Return 1 if input record a comes after input record b: later in the
+ * order, or equal but later in the input, so the selection is stable.
+ */
+static int worse(struct topk *tk, long a, long b) {
+    int c = order_cmp(&tk->opts->order, &tk->in[a], &tk->in[b]);
+    return c > 0 || (c == 0 && a > b);
+}
+
+/* Restore the heap below pos. The heap holds input positions with the
+ * worst record at the top, so it can be evicted in O(log k).
+ */
+static void sift_down(struct topk *tk, long *heap, long n, long pos) {
+    long top = heap[pos];
+    while (1) {
+        long child = 2 * pos + 1;
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n && worse(tk, heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!worse(tk, heap[child], top)) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = top;
+}
+
+static void select_task(long w, void *arg) {
+    struct topk *tk = arg;
+    long first = part_start(w, tk->size, tk->n);
+    long last = first + part_size(w, tk->size, tk->n);
+    struct timespec wall, cpu, wall_end, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    // a slice smaller than k keeps all of its records
+    long cap = last - first < tk->k ? last - first : tk->k;
+    long *heap = malloc(cap * sizeof(long));
+    if (heap == NULL && cap > 0) {
+        perror("malloc");
+        exit(1);
+    }
+    long n = 0;
+    for (long i = first; i < last; i++) {
+        if (n < cap) {
+            // fill up, sifting each new record up into place
+            long pos = n++;
+            while (pos > 0 && worse(tk, i, heap[(pos - 1) / 2])) {
+                heap[pos] = heap[(pos - 1) / 2];
+                pos = (pos - 1) / 2;
+            }
+            heap[pos] = i;
+        } else if (worse(tk, heap[0], i)) {
+            heap[0] = i;
+            sift_down(tk, heap, n, 0);
+        }
+    }
+    // pop the worst record to the back until the kept run is sorted
+    struct rec *kept = tk->kept + tk->offset[w];
+    tk->n_kept[w] = n;
+    for (long left = n; left > 0; left--) {
+        kept[left - 1] = tk->in[heap[0]];
+        heap[0] = heap[left - 1];
+        sift_down(tk, heap, left - 1, 0);
+    }
+    free(heap);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    stats_task(w, last - first, "heap select", 0,
+               (wall_end.tv_sec - wall.tv_sec) * 1e3 +
+               (wall_end.tv_nsec - wall.tv_nsec) / 1e6,
+               (cpu_end.tv_sec - cpu.tv_sec) * 1e3 +
+               (cpu_end.tv_nsec - cpu.tv_nsec) / 1e6);
+    if (tk->opts->verbose) {
+        fprintf(stderr, "worker %ld: kept %ld of %ld records\n", w, n, last - first);
+    }
+}
+
+void sort_topk(char *input_file, char *output_file, long size, int n_workers,
+               long k, struct psort_opts *opts) {
+    long n_out = k < size ? k : size;
+    if (n_out == 0) {
+        map_output(output_file, 0);
+        return;
+    }
+    void *base;
+    size_t len;
+    struct topk tk;
+    stats_phase(PHASE_READ);
+    tk.in = map_part(input_file, 0, size, &base, &len);
+    tk.size = size;
+    tk.n = n_workers;
+    tk.k = n_out;
+    tk.opts = opts;
+    // every worker keeps at most k records, and at most its slice
+    tk.offset = malloc((n_workers + 1) * sizeof(long));
+    if (tk.offset == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    tk.offset[0] = 0;
+    for (int w = 0; w < n_workers; w++) {
+        long part = part_size(w, size, n_workers);
+        tk.offset[w + 1] = tk.offset[w] + (part < n_out ? part : n_out);
+    }
+    tk.kept = alloc_shared(tk.offset[n_workers] * sizeof(struct rec));
+    tk.n_kept = alloc_shared(n_workers * sizeof(long));
+    stats_tasks(n_workers);
+    stats_phase(PHASE_SORT);
+    run_workers(n_workers, opts->threads, select_task, &tk);
+    stats_phase(PHASE_MERGE);
+    // the kept records are all that is left to read, so the output may
+    // replace the input from here on
+    munmap(base, len);
+    struct rec *out = map_output(output_file, n_out);
+
+    struct run runs[n_workers];
+    for (int w = 0; w < n_workers; w++) {
+        runs[w].recs = tk.kept + tk.offset[w];
+        runs[w].n = tk.n_kept[w];
+    }
+    if (merge_slice(runs, n_workers, 0, n_out, out, &opts->order) == -1) {
+        exit(1);
+    }
+
+    stats_phase(PHASE_WRITE);
+    munmap(tk.n_kept, n_workers * sizeof(long));
+    munmap(tk.kept, tk.offset[n_workers] * sizeof(struct rec));
+    free(tk.offset);
+    if (munmap(out, n_out * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+}
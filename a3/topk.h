@@ -0,0 +1,8 @@
+#ifndef _TOPK_H
+#define _TOPK_H
+
+#include "helper.h"
+
+void sort_topk(char *input_file, char *output_file, long size, int n_workers,
+               long k, struct psort_opts *opts);
+#endif /* _TOPK_H */
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "pool.h"
+#include "stats.h"
+#include "update.h"
+
+/* Incremental update: fold unsorted delta files into a file that is
+ * already sorted in the same order. Only the deltas are sorted, in
+ * n_workers slices; the base file is then just one more sorted run of
+ * the co-ranked parallel merge that writes the output. Records of the
+ * base go before equal records of the deltas, and the deltas keep
+ * their order on the command line.
+ */
+
+struct update {
+    struct run *runs;       // the base, then the delta slices
+    int n_runs;
+    struct rec *out;
+    long size;
+    int n_workers;
+    struct psort_opts *opts;
+};
+
+/* Sort delta slice t, and check that slice t of the base is in order:
+ * the merge would quietly write a wrong output if it were not.
+ */
+static void sort_task(long t, void *arg) {
+    struct update *u = arg;
+    struct run *r = &u->runs[t + 1];
+    if (worker_sort(t, r->recs, r->n, r->recs, u->opts) == -1) {
+        exit(1);
+    }
+    struct rec *base = u->runs[0].recs;
+    long first = part_start(t, u->runs[0].n, u->n_workers);
+    long last = first + part_size(t, u->runs[0].n, u->n_workers);
+    for (long i = first > 0 ? first : 1; i < last; i++) {
+        if (order_cmp(&u->opts->order, &base[i - 1], &base[i]) > 0) {
+            fprintf(stderr, "psort: the -u file is not sorted at record %ld\n", i);
+            exit(1);
+        }
+    }
+}
+
+static void merge_task(long t, void *arg) {
+    struct update *u = arg;
+    long lo = part_start(t, u->size, u->n_workers);
+    if (merge_slice(u->runs, u->n_runs, lo, lo + part_size(t, u->size, u->n_workers),
+                    u->out, &u->opts->order) == -1) {
+        exit(1);
+    }
+}
+
+void sort_update(char *base_file, char **delta_files, int n_deltas,
+                 char *output_file, int n_workers, struct psort_opts *opts) {
+    long base_size = get_file_size(base_file) / sizeof(struct rec);
+    long n_new = 0;
+    for (int d = 0; d < n_deltas; d++) {
+        n_new += get_file_size(delta_files[d]) / sizeof(struct rec);
+    }
+    struct update u;
+    u.size = base_size + n_new;
+    u.n_workers = n_workers;
+    u.n_runs = n_workers + 1;
+    u.opts = opts;
+    u.out = map_output(output_file, u.size);
+    if (u.size == 0) {
+        return;
+    }
+
+    // gather the deltas in memory forked workers share with the parent
+    stats_phase(PHASE_READ);
+    void *base_map = NULL;
+    size_t base_len = 0;
+    struct run runs[u.n_runs];
+    runs[0].recs = base_size > 0 ? map_part(base_file, 0, base_size, &base_map,
+                                            &base_len) : NULL;
+    runs[0].n = base_size;
+    struct rec *delta = n_new > 0 ? alloc_shared(n_new * sizeof(struct rec)) : NULL;
+    long pos = 0;
+    for (int d = 0; d < n_deltas; d++) {
+        long n = get_file_size(delta_files[d]) / sizeof(struct rec);
+        if (n == 0) {
+            continue;
+        }
+        void *map;
+        size_t len;
+        memcpy(delta + pos, map_part(delta_files[d], 0, n, &map, &len),
+               n * sizeof(struct rec));
+        munmap(map, len);
+        pos += n;
+    }
+    for (int w = 0; w < n_workers; w++) {
+        runs[w + 1].recs = delta + part_start(w, n_new, n_workers);
+        runs[w + 1].n = part_size(w, n_new, n_workers);
+    }
+    u.runs = runs;
+
+    stats_tasks(n_workers);
+    stats_phase(PHASE_SORT);
+    run_workers(n_workers, opts->threads, sort_task, &u);
+    stats_phase(PHASE_MERGE);
+    run_workers(n_workers, opts->threads, merge_task, &u);
+
+    stats_phase(PHASE_WRITE);
+    if (delta != NULL) {
+        munmap(delta, n_new * sizeof(struct rec));
+    }
+    if (base_map != NULL) {
+        munmap(base_map, base_len);
+    }
+    if (munmap(u.out, u.size * sizeof(struct rec)) == -1) {
+        perror("munmap");
+        exit(1);
+    }
+}
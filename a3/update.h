@@ -0,0 +1,8 @@
+#ifndef _UPDATE_H
+#define _UPDATE_H
+
+#include "helper.h"
+
+void sort_update(char *base_file, char **delta_files, int n_deltas,
+                 char *output_file, int n_workers, struct psort_opts *opts);
+#endif /* _UPDATE_H */
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "helper.h"
+#include "compact.h"
+
+#define USAGE "Usage: v2conv [-r] -f <input file name> -o <output file name>\n"
+
+/* Records are read this many at a time. */
+#define CONV_BATCH 4096
+
+/* Write the 48-byte records of input_file to output_file as a v2 file.
+ * The entries and the pool are written in one pass, through two streams
+ * on the output: the entry count, and so where the pool starts, follows
+ * from the size of the input.
+ */
+void to_compact(char *input_file, char *output_file) {
+    long count = get_file_size(input_file) / sizeof(struct rec);
+    FILE *infp = fopen(input_file, "r");
+    FILE *entries = fopen(output_file, "w");
+    FILE *pool = fopen(output_file, "r+");
+    if (infp == NULL || entries == NULL || pool == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    struct v2_header hdr;
+    memcpy(hdr.magic, V2_MAGIC, 4);
+    hdr.version = V2_VERSION;
+    hdr.count = count;
+    hdr.pool_size = 0;
+    if (fseek(entries, sizeof(hdr), SEEK_SET) == -1 ||
+        fseek(pool, sizeof(hdr) + count * sizeof(struct v2_rec), SEEK_SET) == -1) {
+        perror("fseek");
+        exit(1);
+    }
+    struct rec batch[CONV_BATCH];
+    size_t n;
+    while ((n = fread(batch, sizeof(struct rec), CONV_BATCH, infp)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            size_t len = strnlen(batch[i].word, SIZE);
+            if (hdr.pool_size + len + 1 > 0xffffffffL) {
+                fprintf(stderr, "v2conv: the words of %s need more than 4GB\n",
+                        input_file);
+                exit(1);
+            }
+            struct v2_rec e = {batch[i].freq, hdr.pool_size};
+            if (fwrite(&e, sizeof(e), 1, entries) != 1 ||
+                fwrite(batch[i].word, 1, len, pool) != len ||
+                fputc('\0', pool) == EOF) {
+                perror("fwrite");
+                exit(1);
+            }
+            hdr.pool_size += len + 1;
+        }
+    }
+    if (ferror(infp)) {
+        perror("fread");
+        exit(1);
+    }
+    // the header goes in last, once the pool size is known
+    if (fseek(entries, 0, SEEK_SET) == -1 ||
+        fwrite(&hdr, sizeof(hdr), 1, entries) != 1) {
+        perror("fwrite");
+        exit(1);
+    }
+    if (fclose(pool) != 0 || fclose(entries) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+    fclose(infp);
+}
+
+/* Write the v2 file input_file back out as 48-byte records. */
+void from_compact(char *input_file, char *output_file) {
+    if (compact_count(input_file) == -1) {
+        fprintf(stderr, "v2conv: %s is not a valid v2 file\n", input_file);
+        exit(1);
+    }
+    size_t len = get_file_size(input_file);
+    int fd = open(input_file, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        exit(1);
+    }
+    char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    struct v2_header *hdr = (struct v2_header *) base;
+    struct v2_rec *entries = (struct v2_rec *) (hdr + 1);
+    char *pool = (char *) (entries + hdr->count);
+    if (hdr->pool_size > 0 && pool[hdr->pool_size - 1] != '\0') {
+        fprintf(stderr, "v2conv: %s has an unterminated word pool\n", input_file);
+        exit(1);
+    }
+    FILE *ofp = fopen(output_file, "w");
+    if (ofp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    for (long i = 0; i < hdr->count; i++) {
+        if (entries[i].word >= hdr->pool_size) {
+            fprintf(stderr, "v2conv: %s has a word outside its pool\n", input_file);
+            exit(1);
+        }
+        struct rec record;
+        memset(&record, 0, sizeof(record));
+        record.freq = entries[i].freq;
+        char *word = pool + entries[i].word;
+        memcpy(record.word, word, strnlen(word, SIZE));
+        if (fwrite(&record, sizeof(record), 1, ofp) != 1) {
+            perror("fwrite");
+            exit(1);
+        }
+    }
+    if (fclose(ofp) != 0) {
+        perror("fclose");
+        exit(1);
+    }
+    munmap(base, len);
+}
+
+/* Convert a file of 48-byte records to the compact v2 format that psort
+ * reads natively, or with -r a v2 file back to 48-byte records.
+ */
+int main(int argc, char *argv[]) {
+    extern char *optarg;
+    int ch;
+    char *infile = NULL, *outfile = NULL;
+    int reverse = 0;
+
+    while ((ch = getopt(argc, argv, "f:o:r")) != -1) {
+        switch(ch) {
+        case 'f':
+            infile = optarg;
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'r':
+            reverse = 1;
+            break;
+        default:
+            fprintf(stderr, USAGE);
+            exit(1);
+        }
+    }
+    if (infile == NULL || outfile == NULL) {
+        fprintf(stderr, USAGE);
+        exit(1);
+    }
+    if (reverse) {
+        from_compact(infile, outfile);
+    } else {
+        to_compact(infile, outfile);
+    }
+    return 0;
+}
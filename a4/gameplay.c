@@ -26,42 +26,17 @@ char *status_message(char *msg, struct game_state *game) {
 
 
 /* Initialize the gameboard: 
- *    - initialize dictionary
- *    - select a random word to guess from the dictionary file
+ *    - select a random word to guess from the dictionary
  *    - set guess to all dashes ('-')
  *    - initialize the other fields
  * We can't initialize head and has_next_turn because these will have
  * different values when we use init_game to create a new game after one
  * has already been played
  */
-void init_game(struct game_state *game, char *dict_name) {
-    char buf[MAX_WORD];
-    if(game->dict.fp != NULL) {
-        rewind(game->dict.fp);
-    } else {
-        game->dict.fp = fopen(dict_name, "r");
-        if(game->dict.fp == NULL) {
-            perror("Opening dictionary");
-            exit(1);
-        }
-    } 
-
-    int index = random() % game->dict.size;
+void init_game(struct game_state *game) {
+    int index = rand_r(&game->seed) % game->dict->size;
     printf("Looking for word at index %d\n", index);
-    for(int i = 0; i <= index; i++) {
-        if(!fgets(buf, MAX_WORD, game->dict.fp)){
-            fprintf(stderr,"File ended before we found the entry index %d",index);
-            exit(1);
-        }
-    } 
-
-    // Found word
-    if(buf[strlen(buf) - 1] == '\n') {  // from a unix file
-        buf[strlen(buf) - 1] = '\0';
-    } else {
-        fprintf(stderr, "The dictionary file does not appear to have Unix line endings\n");
-    }
-    strncpy(game->word, buf, MAX_WORD);
+    strncpy(game->word, game->dict->words[index], MAX_WORD);
     game->word[MAX_WORD-1] = '\0';
     for(int j = 0; j < strlen(game->word); j++) {
         game->guess[j] = '-';
@@ -76,6 +51,64 @@ void init_game(struct game_state *game, char *dict_name) {
 }
 
 
+/* Read every word of the dictionary file into dict.
+ */
+void load_dictionary(struct dictionary *dict, char *dict_name) {
+    char buf[MAX_WORD];
+    dict->size = get_file_length(dict_name);
+    if (dict->size == 0) {
+        fprintf(stderr, "The dictionary file is empty\n");
+        exit(1);
+    }
+    dict->words = malloc(dict->size * sizeof(*dict->words));
+    FILE *fp = fopen(dict_name, "r");
+    if (dict->words == NULL || fp == NULL) {
+        perror("Opening dictionary");
+        exit(1);
+    }
+    for (int i = 0; i < dict->size; i++) {
+        if (!fgets(buf, MAX_WORD, fp)) {
+            fprintf(stderr, "File ended before we found the entry index %d", i);
+            exit(1);
+        }
+        int len = strlen(buf);
+        if (len > 0 && buf[len - 1] == '\n') {  // from a unix file
+            buf[len - 1] = '\0';
+        } else if (len == MAX_WORD - 1) {
+            fprintf(stderr, "Word %d is too long, so it is cut short\n", i);
+            int c;
+            while ((c = fgetc(fp)) != '\n' && c != EOF)
+                ;
+        }
+        strcpy(dict->words[i], buf);
+    }
+    fclose(fp);
+}
+
+
+/* Return a new room with no players, playing a word from dict.
+ */
+struct game_state *create_game(struct dictionary *dict, unsigned int seed) {
+    struct game_state *game = calloc(1, sizeof(struct game_state));
+    if (game == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    game->dict = dict;
+    game->seed = seed;
+    init_game(game);
+    return game;
+}
+
+
+/* Free a room whose players have all left.
+ */
+void destroy_game(struct game_state *game) {
+    free(game->names);
+    free(game);
+}
+
+
 /* Return the number of lines in the file
  */
 int get_file_length(char *filename) {
@@ -135,4 +168,92 @@ int guess_done(struct game_state *game, char guess){
         }
 	}
 	return 1;
-}
\ No newline at end of file
+}
+
+/* Return the bucket of name among n_buckets, a power of two (FNV-1a).
+ */
+unsigned int name_bucket(const char *name, int n_buckets) {
+    unsigned int h = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        h = (h ^ (unsigned char) *c) * 16777619u;
+    }
+    return h & (n_buckets - 1);
+}
+
+/* Double the name buckets, or make the first ones, and rehash every
+ * player into them.
+ */
+static void grow_names(struct game_state *game) {
+    int n_buckets = game->n_buckets == 0 ? 64 : 2 * game->n_buckets;
+    struct client **names = calloc(n_buckets, sizeof(struct client *));
+    if (names == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (struct client *p = game->head; p != NULL; p = next_player(game, p)) {
+        unsigned int b = name_bucket(p->name, n_buckets);
+        p->name_next = names[b];
+        names[b] = p;
+    }
+    free(game->names);
+    game->names = names;
+    game->n_buckets = n_buckets;
+}
+
+/* Return the player called name, or NULL if there is none.
+ */
+struct client *find_player(struct game_state *game, char *name) {
+    if (game->n_buckets == 0) {
+        return NULL;
+    }
+    struct client *p = game->names[name_bucket(name, game->n_buckets)];
+    while (p != NULL && strcmp(p->name, name) != 0) {
+        p = p->name_next;
+    }
+    return p;
+}
+
+/* Make p, who has a name no player has, a player. p goes first in the
+ * ring, so p's turn comes after everyone who joined before.
+ */
+void add_to_game(struct game_state *game, struct client *p) {
+    if (game->head == NULL) {
+        p->next = p->prev = p;
+        game->has_next_turn = p;
+    } else {
+        p->next = game->head;
+        p->prev = game->head->prev;
+        p->prev->next = p;
+        p->next->prev = p;
+    }
+    game->head = p;
+    game->n_players++;
+    if (game->n_players > game->n_buckets) {
+        grow_names(game);   // hashes p too
+    } else {
+        unsigned int b = name_bucket(p->name, game->n_buckets);
+        p->name_next = game->names[b];
+        game->names[b] = p;
+    }
+}
+
+/* Take player p out of the ring and the names. If it was p's turn, the
+ * turn passes to the next player.
+ */
+void remove_from_game(struct game_state *game, struct client *p) {
+    struct client **link = &game->names[name_bucket(p->name, game->n_buckets)];
+    while (*link != p) {
+        link = &(*link)->name_next;
+    }
+    *link = p->name_next;
+    struct client *next = p->next == p ? NULL : p->next;
+    p->prev->next = p->next;
+    p->next->prev = p->prev;
+    if (game->head == p) {
+        game->head = next;
+    }
+    if (game->has_next_turn == p) {
+        game->has_next_turn = next;
+    }
+    game->n_players--;
+}
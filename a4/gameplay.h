@@ -11,15 +11,24 @@
 struct client {
     int fd;
     struct in_addr ipaddr;
-    struct client *next;
+    struct client *next;      // The next player in turn order, in a ring
+    struct client *prev;      // The player before, so leaving needs no scan
+    struct client *name_next; // The next player in the same name bucket
     char name[MAX_NAME];
     char inbuf[MAX_BUF];  // Used to hold input from the client
     char *in_ptr;         // A pointer into inbuf to help with partial reads
+    char *outbuf;         // Output the socket has not taken yet
+    int out_len;          // The number of bytes waiting in outbuf
+    int out_size;         // The number of bytes outbuf can hold
+    int hung_up;          // The socket is shut down; output is dropped
+    struct game_state *game;  // The room the client plays in, NULL until
+                              // it has a name
 };
 
-// Information about the dictionary used to pick random word
+// The dictionary used to pick random words, read once and shared by
+// every room
 struct dictionary {
-    FILE *fp;
+    char (*words)[MAX_WORD];
     int size;
 };
 
@@ -29,14 +38,35 @@ struct game_state {
     int letters_guessed[NUM_LETTERS]; // Index i will be 1 if the corresponding
                                       // letter has been guessed; 0 otherwise
     int guesses_left;         // Number of guesses remaining
-    struct dictionary dict;
+    struct dictionary *dict;
+    unsigned int seed;        // rand_r() state for picking this room's words
     
-    struct client *head;
+    struct client *head;          // The ring of players, newest first
     struct client *has_next_turn;
+    struct client **names;        // The players hashed by name
+    int n_buckets;                // A power of two, or 0 before any player
+    int n_players;
+    int joining;                  // Players handed over from another event
+                                  // loop who have yet to join
 };
 
+/* Return the player after p when visiting the ring once from head, or
+ * NULL once every player has been visited.
+ */
+static inline struct client *next_player(struct game_state *game,
+                                         struct client *p) {
+    return p->next == game->head ? NULL : p->next;
+}
 
-void init_game(struct game_state *game, char *dict_name);
+
+void load_dictionary(struct dictionary *dict, char *dict_name);
+struct game_state *create_game(struct dictionary *dict, unsigned int seed);
+void destroy_game(struct game_state *game);
+void init_game(struct game_state *game);
 int get_file_length(char *filename);
 char *status_message(char *msg, struct game_state *game);
-int guess_done(struct game_state *game, char guess);
\ No newline at end of file
+int guess_done(struct game_state *game, char guess);
+void add_to_game(struct game_state *game, struct client *p);
+void remove_from_game(struct game_state *game, struct client *p);
+struct client *find_player(struct game_state *game, char *name);
+unsigned int name_bucket(const char *name, int n_buckets);
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>     /* inet_ntoa */
 #include <netdb.h>         /* gethostname */
 #include <sys/socket.h>
@@ -50,6 +52,15 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
         exit(1);
     }
 
+    // Let every event loop bind its own socket to the port; the kernel
+    // then spreads the incoming connections across them.
+    status = setsockopt(soc, SOL_SOCKET, SO_REUSEPORT,
+        (const char *) &on, sizeof(on));
+    if (status < 0) {
+        perror("setsockopt");
+        exit(1);
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)self, sizeof(*self)) < 0) {
         // bind failed; could be because port is in use.
@@ -69,28 +80,52 @@ int set_up_server_socket(struct sockaddr_in *self, int num_queue) {
 
 
 /*
- * Wait for and accept a new connection.
- * Terminate with exit code 1 if the accept call failed, otherwise return
- * the client's socket descriptor.
+ * Accept a pending connection and store the client's address in addr.
+ * Return the client's socket descriptor, or -1 if no connection is
+ * pending on the (non-blocking) listening socket, or if the process is
+ * out of descriptors or memory for one; errno then tells which. Terminate
+ * with exit code 1 if the accept call failed otherwise.
  */
-int accept_connection(int listenfd) {
+int accept_connection(int listenfd, struct in_addr *addr) {
     struct sockaddr_in peer;
     unsigned int peer_len = sizeof(peer);
     peer.sin_family = PF_INET;
 
-    printf("Waiting for a new connection...\n");
-    int client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
+    int client_socket;
+    do {
+        client_socket = accept(listenfd, (struct sockaddr *)&peer, &peer_len);
+    } while (client_socket < 0 && (errno == EINTR || errno == ECONNABORTED));
     if (client_socket < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        int err = errno;
         perror("accept");
+        if (err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM) {
+            errno = err;
+            return -1;
+        }
         exit(1);
     } else {
         printf("New connection accepted from %s:%d\n",
             inet_ntoa(peer.sin_addr),
             ntohs(peer.sin_port));
+        *addr = peer.sin_addr;
         return client_socket;
     }
 }
 
+/*
+ * Make calls on fd that would block fail with EAGAIN instead.
+ */
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+}
+
 int find_network_newline(const char *buf, int n) {
     for (int i = 0; i < n - 1; i++)
     {
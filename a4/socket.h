@@ -5,6 +5,7 @@
 
 struct sockaddr_in *init_server_addr(int port);
 int set_up_server_socket(struct sockaddr_in *self, int num_queue);
-int accept_connection(int listenfd);
+int accept_connection(int listenfd, struct in_addr *addr);
+void set_nonblocking(int fd);
 int find_network_newline(const char *buf, int n);
 #endif
@@ -6,11 +6,15 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <time.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "socket.h"
 #include "gameplay.h"
@@ -19,11 +23,82 @@
 #ifndef PORT
     #define PORT 58966
 #endif
-#define MAX_QUEUE 5
+#ifndef ROOM_PLAYERS
+    #define ROOM_PLAYERS 8
+#endif
+#define MAX_QUEUE SOMAXCONN
+// The most events one epoll_wait call hands back
+#define MAX_EVENTS 64
+// A client that lets this much output pile up is not reading; hang up
+#define MAX_OUTBUF 65536
+// How long to wait before accepting again once out of descriptors
+#define ACCEPT_BACKOFF_MS 1000
+
+
+/* A player's name, as the lobby keeps it. */
+struct name {
+    char name[MAX_NAME];
+    struct name *next;      // The next name in the same bucket
+};
+
+/* What the loops share. Players fill one room at a time, whichever loop
+ * accepted them, and no two players anywhere have the same name. All of
+ * it is guarded by lock.
+ */
+struct lobby {
+    pthread_mutex_t lock;
+    struct game_state *open;    // The room new players join until it is full
+    struct loop *owner;         // The loop that serves the open room
+    int n_joined;               // The players the open room has been given
+    struct name **names;        // Every player's name, hashed
+    int n_buckets;              // A power of two, or 0 before any player
+    int n_names;
+};
+
+/* One event loop, run by a thread of its own. Every loop listens on the
+ * port through its own socket, and SO_REUSEPORT has the kernel spread
+ * new connections across them. A room is served by the loop that opened
+ * it, so a client whose name puts it in another loop's room is handed
+ * over to that loop. Each room is then only touched by one thread, and
+ * loops share nothing but the dictionary and the lobby.
+ */
+struct loop {
+    int listenfd;
+    /* The epoll instance that watches listenfd and every client.
+     * Each client's event carries a pointer to its struct client, and
+     * the listening socket's a NULL pointer, so an event needs no lookup.
+     * Closing a socket takes it out of the set.
+     */
+    int epfd;
+    /* Every client, players and those still choosing a name alike,
+     * indexed by socket descriptor. It grows to hold the largest
+     * descriptor.
+     */
+    struct client **clients;
+    int clients_size;
+    struct lobby *lobby;
+    struct dictionary *dict;
+    unsigned int seed;          // rand_r() state for seeding new rooms
+    /* Clients other loops have handed over to join this loop's room,
+     * linked through next, newest first, and the eventfd that wakes the
+     * loop to take them. The epoll event of wakefd points at wakefd.
+     */
+    pthread_mutex_t handoff_lock;
+    struct client *handoff;
+    int wakefd;
+    /* When accepting failed for want of descriptors or memory, the time
+     * on now_ms()'s clock to try again, and 0 otherwise. The listening
+     * socket is edge-triggered and will not report the connections still
+     * pending, so the loop retries on its own.
+     */
+    long accept_at;
+};
 
 
-void add_player(struct client **top, int fd, struct in_addr addr);
-void remove_player(struct client **top, int fd);
+struct client *add_player(struct loop *loop, int fd, struct in_addr addr);
+void remove_player(struct loop *loop, int fd);
+void send_msg(struct client *p, char *msg);
+void flush_client(struct client *p);
 
 /* These are some of the function prototypes that we used in our solution 
  * You are not required to write functions that match these prototypes, but
@@ -37,16 +112,30 @@ void announce_winner(struct game_state *game, struct client *winner);
 void advance_turn(struct game_state *game);
 
 
-/* The set of socket descriptors for select to monitor.
- * This is a global variable because we need to remove socket descriptors
- * from allset when a write to a socket fails.
+/* Put p in the loop's table of clients, growing it to hold p's socket.
  */
-fd_set allset;
-
+void track_client(struct loop *loop, struct client *p) {
+    int fd = p->fd;
+    if (fd >= loop->clients_size) {
+        int size = loop->clients_size == 0 ? 64 : loop->clients_size;
+        while (size <= fd) {
+            size *= 2;
+        }
+        loop->clients = realloc(loop->clients, size * sizeof(struct client *));
+        if (loop->clients == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(loop->clients + loop->clients_size, 0,
+               (size - loop->clients_size) * sizeof(struct client *));
+        loop->clients_size = size;
+    }
+    loop->clients[fd] = p;
+}
 
-/* Add a client to the head of the linked list
+/* Add a client that has yet to choose a name to the table and return it
  */
-void add_player(struct client **top, int fd, struct in_addr addr) {
+struct client *add_player(struct loop *loop, int fd, struct in_addr addr) {
     struct client *p = malloc(sizeof(struct client));
 
     if (!p) {
@@ -61,50 +150,123 @@ void add_player(struct client **top, int fd, struct in_addr addr) {
     p->name[0] = '\0';
     p->in_ptr = p->inbuf;
     p->inbuf[0] = '\0';
-    p->next = *top;
-    *top = p;
+    p->outbuf = NULL;
+    p->out_len = 0;
+    p->out_size = 0;
+    p->hung_up = 0;
+    p->game = NULL;
+    track_client(loop, p);
+    return p;
 }
 
-/* Removes client from the linked list and closes its socket.
- * Also removes socket descriptor from allset 
+/* Removes client from the table, and from its room if it is a player,
+ * and closes its socket, which also removes it from the loop's epfd.
  */
-void remove_player(struct client **top, int fd) {
-    struct client **p;
-
-    for (p = top; *p && (*p)->fd != fd; p = &(*p)->next)
-        ;
-    // Now, p points to (1) top, or (2) a pointer to another client
-    // This avoids a special case for removing the head of the list
-    if (*p) {
-        struct client *t = (*p)->next;
-        printf("Removing client %d %s\n", fd, inet_ntoa((*p)->ipaddr));
-        FD_CLR((*p)->fd, &allset);
-        close((*p)->fd);
-        free(*p);
-        *p = t;
+void remove_player(struct loop *loop, int fd) {
+    struct client *p = fd < loop->clients_size ? loop->clients[fd] : NULL;
+    if (p) {
+        printf("Removing client %d %s\n", fd, inet_ntoa(p->ipaddr));
+        if (p->game) {
+            remove_from_game(p->game, p);
+        }
+        loop->clients[fd] = NULL;
+        close(fd);
+        free(p->outbuf);
+        free(p);
     } else {
         fprintf(stderr, "Trying to remove fd %d, but I don't know about it\n",
                  fd);
     }
 }
 
+/* Shut p's socket down and drop its output. Reading the socket then
+ * finds the end of the stream, and p is removed like any client that left.
+ */
+void hang_up(struct client *p){
+    shutdown(p->fd, SHUT_RDWR);
+    p->hung_up = 1;
+    p->out_len = 0;
+}
+
+/* Write as much of p's queued output as its socket takes without
+ * blocking. The rest waits for the next EPOLLOUT event.
+ */
+void flush_client(struct client *p){
+    int sent = 0;
+    while (sent < p->out_len){
+        int nbytes = write(p->fd, p->outbuf + sent, p->out_len - sent);
+        if (nbytes == -1 && errno == EINTR){
+            continue;
+        }
+        if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            break;
+        }
+        if (nbytes == -1){
+            // the connection broke
+            hang_up(p);
+            return;
+        }
+        sent += nbytes;
+    }
+    memmove(p->outbuf, p->outbuf + sent, p->out_len - sent);
+    p->out_len -= sent;
+}
+
+/* Send msg to p. Client sockets never block: what p's socket cannot take
+ * yet is queued in p's output buffer, so one slow reader cannot stall the
+ * loop. A client that lets MAX_OUTBUF bytes pile up is hung up on.
+ */
+void send_msg(struct client *p, char *msg){
+    int len = strlen(msg);
+    if (p->hung_up){
+        return;
+    }
+    if (p->out_len + len > MAX_OUTBUF){
+        printf("%s is not reading, hanging up\n", inet_ntoa(p->ipaddr));
+        hang_up(p);
+        return;
+    }
+    if (p->out_len + len > p->out_size){
+        int size = p->out_size == 0 ? MAX_BUF : p->out_size;
+        while (size < p->out_len + len){
+            size *= 2;
+        }
+        char *buf = realloc(p->outbuf, size);
+        if (buf == NULL){
+            perror("realloc");
+            exit(1);
+        }
+        p->outbuf = buf;
+        p->out_size = size;
+    }
+    memcpy(p->outbuf + p->out_len, msg, len);
+    p->out_len += len;
+    // output already waiting means the socket is full until EPOLLOUT
+    if (p->out_len == len){
+        flush_client(p);
+    }
+}
+
 void broadcast(struct game_state *game, char *outbuf){
     struct client *p;
-    for(p = game->head; p != NULL; p = p->next) {
-        write(p->fd, outbuf, strlen(outbuf));
+    for(p = game->head; p != NULL; p = next_player(game, p)) {
+        send_msg(p, outbuf);
     }
 }
 
 void announce_turn(struct game_state *game){
     struct client *p;
-    for(p = game->head; p != NULL; p = p->next) {
+    if (game->has_next_turn == NULL){
+        // the last player has left
+        return;
+    }
+    for(p = game->head; p != NULL; p = next_player(game, p)) {
         if (p != game->has_next_turn){
             char word[MAX_BUF];
             sprintf(word, "it's %s's turn\r\n", (game->has_next_turn)->name);
-            write(p->fd, word, strlen(word));
+            send_msg(p, word);
         }else{
-            char *mess = "your guess\r\n";
-            write(p->fd, mess, strlen(mess));
+            send_msg(p, "your guess\r\n");
         }
     }
     printf("it's %s's turn\n", (game->has_next_turn)->name);
@@ -112,14 +274,13 @@ void announce_turn(struct game_state *game){
 
 void announce_winner(struct game_state *game, struct client *winner){
     struct client *p;
-    for(p = game->head; p != NULL; p = p->next) {
+    for(p = game->head; p != NULL; p = next_player(game, p)) {
         if (p != winner){
             char word[MAX_BUF];
             sprintf(word, "Game over! %s won!\r\n", winner->name);
-            write(p->fd, word, strlen(word));
+            send_msg(p, word);
         }else{
-            char *mess = "Game over! You won!\r\n";
-            write(p->fd, mess, MAX_BUF);
+            send_msg(p, "Game over! You won!\r\n");
         }
     }
     printf("Game over! %s won!\n", winner->name);
@@ -127,47 +288,491 @@ void announce_winner(struct game_state *game, struct client *winner){
 
 void advance_turn(struct game_state *game){
     game->has_next_turn = game->has_next_turn->next;
-    if (game->has_next_turn == NULL){
-        game->has_next_turn = game->head;
+}
+
+/* Copy the first complete line in p's buffer, without its network
+ * newline, into line and remove it from the buffer. Return the length of
+ * the line, or -1 if no complete line has arrived yet.
+ */
+int next_line(struct client *p, char *line){
+    int len = p->in_ptr - p->inbuf;
+    int end = find_network_newline(p->inbuf, len);
+    if (end == -1){
+        return -1;
+    }
+    memcpy(line, p->inbuf, end);
+    line[end] = '\0';
+    memmove(p->inbuf, p->inbuf + end + 2, len - end - 2);
+    p->in_ptr -= end + 2;
+    *(p->in_ptr) = '\0';
+    printf("find new line %s\n", line);
+    return strlen(line);
+}
+
+/* Start a new game with a new word once the last one is over. */
+void new_game(struct game_state *game){
+    init_game(game);
+    advance_turn(game);
+    printf("New Game\n");
+    broadcast(game, "\r\n\r\n\r\n");
+    announce_turn(game);
+}
+
+/* Act on a line from p, who is a player: a guess if it is p's turn.
+ */
+void play_turn(struct game_state *game, struct client *p, char *ca){
+    if (p != game->has_next_turn){
+        send_msg(p, "it's not your turn\r\n");
+        printf("%s tried to gues out of turn\n", p->name);
+        return;
+    }
+    if (strlen(ca) != 1 || (*ca < 'a' || *ca > 'z')){
+        // what we do when input is nor vailed
+        send_msg(p, "invailed input\r\nyour guess\r\n");
+        return;
+    }
+    int what_happen = guess_done(game, *ca);
+    if (what_happen == -1){
+        //when input is already have
+        send_msg(p, "guess already have\r\nyour guess?\r\n");
+    }else if(what_happen == 0){
+        // wrong guss
+        char messg[MAX_BUF];
+        printf("%s's guess is %s\n", p->name, ca);
+        sprintf(messg, "%s's guess is %s\r\n", p->name, ca);
+        broadcast(game, messg);
+        memset(messg, '\0', MAX_BUF);
+        sprintf(messg, "Letter %s is not in the word\r\n", ca);
+        printf("Letter %s is not in the word\n", ca);
+        send_msg(p, messg);
+        broadcast(game, status_message(messg, game));
+        advance_turn(game);
+        announce_turn(game);
+    }else if(what_happen == 1){
+        //this player win
+        announce_winner(game, p);
+        new_game(game);
+    }else if(what_happen == 3) {
+        // right guess
+        char messg[MAX_BUF];
+        sprintf(messg, "%s's guess is %s\r\n", p->name, ca);
+        broadcast(game, messg);
+        broadcast(game, status_message(messg, game));
+        announce_turn(game);
+    }else{
+        // no guess left
+        char mess[MAX_BUF];
+        broadcast(game, status_message(mess, game));
+        memset(mess, '\0', MAX_BUF);
+        sprintf(mess, "haha, Game over!\r\nThe word is %s\r\nplay new game\r\n", game->word);
+        broadcast(game, mess);
+        new_game(game);
+    }
+}
+
+/* Take name for a player unless a player has it already. Return 1 if
+ * the name was free. The lobby must be locked.
+ */
+int claim_name(struct lobby *lobby, char *name){
+    if (lobby->n_buckets > 0){
+        struct name *n = lobby->names[name_bucket(name, lobby->n_buckets)];
+        for (; n != NULL; n = n->next){
+            if (strcmp(n->name, name) == 0){
+                return 0;
+            }
+        }
     }
+    if (lobby->n_names == lobby->n_buckets){
+        // double the buckets and rehash every name into them
+        int n_buckets = lobby->n_buckets == 0 ? 64 : 2 * lobby->n_buckets;
+        struct name **names = calloc(n_buckets, sizeof(struct name *));
+        if (names == NULL){
+            perror("calloc");
+            exit(1);
+        }
+        for (int b = 0; b < lobby->n_buckets; b++){
+            struct name *n = lobby->names[b];
+            while (n != NULL){
+                struct name *next = n->next;
+                unsigned int nb = name_bucket(n->name, n_buckets);
+                n->next = names[nb];
+                names[nb] = n;
+                n = next;
+            }
+        }
+        free(lobby->names);
+        lobby->names = names;
+        lobby->n_buckets = n_buckets;
+    }
+    struct name *n = malloc(sizeof(struct name));
+    if (n == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    strcpy(n->name, name);
+    unsigned int b = name_bucket(name, lobby->n_buckets);
+    n->next = lobby->names[b];
+    lobby->names[b] = n;
+    lobby->n_names++;
+    return 1;
+}
+
+/* Give back the name of a player who left. The lobby must be locked.
+ */
+void release_name(struct lobby *lobby, char *name){
+    struct name **link = &lobby->names[name_bucket(name, lobby->n_buckets)];
+    while (strcmp((*link)->name, name) != 0){
+        link = &(*link)->next;
+    }
+    struct name *n = *link;
+    *link = n->next;
+    free(n);
+    lobby->n_names--;
+}
+
+/* Make p, who has a name and the room it was given, a player there and
+ * tell everyone in the room.
+ */
+void enter_game(struct client *p){
+    struct game_state *game = p->game;
+    add_to_game(game, p);
+    char mesg[MAX_BUF];
+    sprintf(mesg,"%s have just joined\r\n", p->name);
+    broadcast(game, mesg);
+    status_message(mesg, game);
+    send_msg(p, mesg);
+    announce_turn(game);
 }
 
-int buf_read(char *word, struct client *p){
+/* Hand p over to the loop to, which serves p's room. The loop from stops
+ * watching p's socket and forgets p; the eventfd wakes to so it takes p
+ * on. from must not touch p again.
+ */
+void hand_over(struct loop *from, struct loop *to, struct client *p){
+    if (epoll_ctl(from->epfd, EPOLL_CTL_DEL, p->fd, NULL) == -1){
+        perror("epoll_ctl");
+        exit(1);
+    }
+    from->clients[p->fd] = NULL;
+    pthread_mutex_lock(&to->handoff_lock);
+    p->next = to->handoff;
+    to->handoff = p;
+    pthread_mutex_unlock(&to->handoff_lock);
+    uint64_t one = 1;
+    if (write(to->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN){
+        perror("write");
+        exit(1);
+    }
+}
+
+/* Act on a line from p, who has not joined yet: the name p asks for.
+ * A valid name no player has makes p a player in the open room, which
+ * fills across all loops. Once the open room is full a new one opens,
+ * served by this loop. Return 1 if p went over to the loop that serves
+ * its room, and must not be touched any more here.
+ */
+int join_game(struct loop *loop, struct client *p, char *name){
+    int name_len = strlen(name);
+    if (name_len == 0){
+        send_msg(p, "Name can not be empty\r\n What is your name?\r\n");
+        return 0;
+    }
+    if (name_len >= MAX_NAME){
+        send_msg(p, "Name too long\r\n What is your name?\r\n");
+        return 0;
+    }
+    struct lobby *lobby = loop->lobby;
+    pthread_mutex_lock(&lobby->lock);
+    if (!claim_name(lobby, name)){
+        pthread_mutex_unlock(&lobby->lock);
+        send_msg(p, "Name already exsits\r\nWhat is your name?\r\n");
+        return 0;
+    }
+    if (lobby->open == NULL || lobby->n_joined == ROOM_PLAYERS){
+        lobby->open = create_game(loop->dict, rand_r(&loop->seed));
+        lobby->owner = loop;
+        lobby->n_joined = 0;
+        printf("New room\n");
+    }
+    strcpy(p->name, name);
+    p->game = lobby->open;
+    lobby->n_joined++;
+    struct loop *owner = lobby->owner;
+    if (owner != loop){
+        // the room stays until p is in it, even if its players all leave
+        p->game->joining++;
+        hand_over(loop, owner, p);
+    }
+    pthread_mutex_unlock(&lobby->lock);
+    if (owner != loop){
+        return 1;
+    }
+    enter_game(p);
+    return 0;
+}
+
+/* Act on every complete line p has sent. Return 1 if p went over to
+ * another loop.
+ */
+int handle_lines(struct loop *loop, struct client *p){
+    char line[MAX_BUF];
+    while (next_line(p, line) != -1){
+        if (p->game){
+            play_turn(p->game, p, line);
+        }else if (join_game(loop, p, line)){
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    int nbytes = read(p->fd, p->in_ptr, MAX_BUF);
-    printf("Read %d bytes\n", nbytes);
-    if (nbytes == -1){
+/* Take on the clients other loops handed over: watch their sockets, put
+ * them in their rooms, and act on what they sent after their names.
+ */
+void take_handoffs(struct loop *loop){
+    uint64_t n;
+    if (read(loop->wakefd, &n, sizeof(n)) == -1 && errno != EAGAIN){
         perror("read");
         exit(1);
     }
-    (p->in_ptr)[nbytes] = '\0'; 
-    if (nbytes == 0){
-        // the play leave return -1
-        return -1;
+    pthread_mutex_lock(&loop->handoff_lock);
+    struct client *list = loop->handoff;
+    loop->handoff = NULL;
+    pthread_mutex_unlock(&loop->handoff_lock);
+    // the list is newest first; players join in the order they came
+    struct client *oldest = NULL;
+    while (list != NULL){
+        struct client *next = list->next;
+        list->next = oldest;
+        oldest = list;
+        list = next;
+    }
+    while (oldest != NULL){
+        struct client *p = oldest;
+        oldest = p->next;
+        track_client(loop, p);
+        // adding the socket reports any input or room for output that
+        // came while p was between loops
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = p;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, p->fd, &ev) == -1){
+            perror("epoll_ctl");
+            exit(1);
+        }
+        pthread_mutex_lock(&loop->lobby->lock);
+        p->game->joining--;
+        pthread_mutex_unlock(&loop->lobby->lock);
+        enter_game(p);
+        handle_lines(loop, p);
     }
-    p->in_ptr += nbytes;
-    char *ptr = NULL;
-    if ((ptr = strstr(p->inbuf, "\r\n")) != NULL){
-        
-        *(ptr) = '\0';
-        printf("find new line %s\n", p->inbuf);
-        strcpy(word, p->inbuf);
-        memset(p->inbuf, '\0', MAX_BUF);
-        p->in_ptr = p->inbuf;
-        // new line found, return length of the word
-        return strlen(word);
-    }
-    // -2 represent no net work new line find during this read
-    return -2;
 }
 
+/* Remove p, who closed the connection, and tell the players in p's room
+ * if p was one of them. A room is closed once its last player leaves,
+ * unless new players are still joining it.
+ */
+void disconnect(struct loop *loop, struct client *p){
+    printf("Disconnect from %s\n", inet_ntoa(p->ipaddr));
+    struct game_state *game = p->game;
+    if (game == NULL){
+        remove_player(loop, p->fd);
+        return;
+    }
+    // a player whose turn it was passes it on as it leaves
+    char mesg[MAX_BUF];
+    sprintf(mesg, "goodbye %s\r\n", p->name);
+    struct lobby *lobby = loop->lobby;
+    pthread_mutex_lock(&lobby->lock);
+    release_name(lobby, p->name);
+    if (game == lobby->open){
+        lobby->n_joined--;
+    }
+    remove_player(loop, p->fd);
+    int closed = game->n_players == 0 && game->joining == 0 &&
+                 game != lobby->open;
+    pthread_mutex_unlock(&lobby->lock);
+    if (closed){
+        destroy_game(game);
+        return;
+    }
+    broadcast(game, mesg);
+    announce_turn(game);
+}
 
-int main(int argc, char **argv) {
-    int clientfd, maxfd, nready;
-    struct client *p;
-    struct sockaddr_in q;
-    fd_set rset;
+/* Read everything p has sent and act on each complete line of it.
+ * Client events are edge-triggered, so the socket is read until it would
+ * block; the next event only comes once more data arrives.
+ */
+void handle_client(struct loop *loop, struct client *p){
+    while (1){
+        int room = MAX_BUF - 1 - (p->in_ptr - p->inbuf);
+        int nbytes = recv(p->fd, p->in_ptr, room, MSG_DONTWAIT);
+        if (nbytes == -1 && errno == EINTR){
+            continue;
+        }
+        if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return;
+        }
+        if (nbytes <= 0){
+            // the client left, or its connection broke
+            disconnect(loop, p);
+            return;
+        }
+        printf("Read %d bytes\n", nbytes);
+        p->in_ptr += nbytes;
+        *(p->in_ptr) = '\0';
+        if (handle_lines(loop, p)){
+            return;
+        }
+        if (p->in_ptr == p->inbuf + MAX_BUF - 1){
+            // no valid line is this long, so drop it rather than stall
+            p->in_ptr = p->inbuf;
+            *(p->in_ptr) = '\0';
+        }
+    }
+}
+
+/* Return the time in milliseconds on a clock that only moves forward.
+ */
+long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Accept every pending connection as a new player and ask for its name.
+ * If the process runs out of descriptors or memory, the connections left
+ * wait in the listen queue until run_loop tries again ACCEPT_BACKOFF_MS
+ * later.
+ */
+void accept_players(struct loop *loop){
+    int clientfd;
+    struct in_addr addr;
+    while ((clientfd = accept_connection(loop->listenfd, &addr)) != -1){
+        printf("Connection from %s\n", inet_ntoa(addr));
+        set_nonblocking(clientfd);
+        struct client *p = add_player(loop, clientfd, addr);
+        // an edge-triggered EPOLLOUT comes when a full socket has room
+        // again, and flushes the output that waited for it
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = p;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, clientfd, &ev) == -1){
+            perror("epoll_ctl");
+            exit(1);
+        }
+        send_msg(p, WELCOME_MSG);
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK){
+        loop->accept_at = 0;
+    }else{
+        loop->accept_at = now_ms() + ACCEPT_BACKOFF_MS;
+    }
+}
+
+/* Every player holds a socket, so allow as many open files as we may.
+ */
+void raise_fd_limit(void){
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1){
+            perror("setrlimit");
+        }
+    }
+}
+
+
+/* Set up loop to listen on server and play words from dict.
+ */
+void init_loop(struct loop *loop, struct sockaddr_in *server,
+               struct lobby *lobby, struct dictionary *dict, unsigned int seed){
+    loop->lobby = lobby;
+    loop->dict = dict;
+    loop->seed = seed;
+    pthread_mutex_init(&loop->handoff_lock, NULL);
+    loop->listenfd = set_up_server_socket(server, MAX_QUEUE);
+    // accept_players takes connections until none is left
+    set_nonblocking(loop->listenfd);
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    loop->wakefd = eventfd(0, EFD_NONBLOCK);
+    if (loop->wakefd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &loop->wakefd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
 
+/* Serve the loop's clients forever.
+ */
+void *run_loop(void *arg){
+    struct loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int timeout = -1;
+        if (loop->accept_at != 0) {
+            long wait = loop->accept_at - now_ms();
+            timeout = wait > 0 ? wait : 0;
+        }
+        int nready = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        /* Every event points at its client, so each is dispatched
+         * directly. A handler only ever removes its own client, and a
+         * client has at most one event per epoll_wait, so later events
+         * in the batch still point at live clients. Output is flushed
+         * before input is read, since reading may remove the client.
+         */
+        for (int i = 0; i < nready; i++) {
+            if (events[i].data.ptr == &loop->wakefd) {
+                take_handoffs(loop);
+                continue;
+            }
+            struct client *p = events[i].data.ptr;
+            if (p == NULL) {
+                // while backing off, new connections wait for the retry
+                if (loop->accept_at == 0) {
+                    accept_players(loop);
+                }
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_client(p);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                handle_client(loop, p);
+            }
+        }
+        if (loop->accept_at != 0 && now_ms() >= loop->accept_at) {
+            accept_players(loop);
+        }
+    }
+    return NULL;
+}
+
+
+int main(int argc, char **argv) {
     struct sigaction sa;
     sa.sa_handler = SIG_IGN;
     sa.sa_flags = 0;
@@ -177,255 +782,48 @@ int main(int argc, char **argv) {
         exit(1);
     }
     
-    if(argc != 2){
-        fprintf(stderr,"Usage: %s <dictionary filename>\n", argv[0]);
+    // one event loop per core unless told otherwise
+    int n_loops = argc == 3 ? strtol(argv[2], NULL, 10)
+                            : sysconf(_SC_NPROCESSORS_ONLN);
+    if((argc != 2 && argc != 3) || n_loops <= 0){
+        fprintf(stderr,"Usage: %s <dictionary filename> [<event loops>]\n", argv[0]);
         exit(1);
     }
     
-    // Create and initialize the game state
-    struct game_state game;
-
-    srandom((unsigned int)time(NULL));
-    // Set up the file pointer outside of init_game because we want to 
-    // just rewind the file when we need to pick a new word
-    game.dict.fp = NULL;
-    game.dict.size = get_file_length(argv[1]);
-
-    init_game(&game, argv[1]);
+    // Every room picks its words from one copy of the dictionary
+    struct dictionary dict;
+    load_dictionary(&dict, argv[1]);
     
-    // head and has_next_turn also don't change when a subsequent game is
-    // started so we initialize them here.
-    game.head = NULL;
-    game.has_next_turn = NULL;
-    
-    /* A list of client who have not yet entered their name.  This list is
-     * kept separate from the list of active players in the game, because
-     * until the new playrs have entered a name, they should not have a turn
-     * or receive broadcast messages.  In other words, they can't play until
-     * they have a name.
+    /* Clients who have not yet entered their name are only in their
+     * loop's client table, not in a room, because until the new players
+     * have entered a name, they should not have a turn or receive
+     * broadcast messages. In other words, they can't play until they
+     * have a name.
      */
-    struct client *new_players = NULL;
     
+    raise_fd_limit();
     struct sockaddr_in *server = init_server_addr(PORT);
-    int listenfd = set_up_server_socket(server, MAX_QUEUE);
-    
-    // initialize allset and add listenfd to the
-    // set of file descriptors passed into select
-    FD_ZERO(&allset);
-    FD_SET(listenfd, &allset);
-    // maxfd identifies how far into the set to search
-    maxfd = listenfd;
-
-    while (1) {
-        // make a copy of the set before we pass it into select
-        rset = allset;
-        nready = select(maxfd + 1, &rset, NULL, NULL, NULL);
-        if (nready == -1) {
-            perror("select");
-            continue;
-        }
-
-        if (FD_ISSET(listenfd, &rset)){
-            printf("A new client is connecting\n");
-            clientfd = accept_connection(listenfd);
-
-            FD_SET(clientfd, &allset);
-            if (clientfd > maxfd) {
-                maxfd = clientfd;
-            }
-            printf("Connection from %s\n", inet_ntoa(q.sin_addr));
-            add_player(&new_players, clientfd, q.sin_addr);
-            char *greeting = WELCOME_MSG;
-            if(write(clientfd, greeting, strlen(greeting)) == -1) {
-                fprintf(stderr, "Write to client %s failed\n", inet_ntoa(q.sin_addr));
-                printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                remove_player(&new_players, clientfd);
-            }
-        }
-        /* Check which other socket descriptors have something ready to read.
-         * The reason we iterate over the rset descriptors at the top level and
-         * search through the two lists of clients each time is that it is
-         * possible that a client will be removed in the middle of one of the
-         * operations. This is also why we call break after handling the input.
-         * If a client has been removed the loop variables may not longer be 
-         * valid.
-         */
-
-        for(int cur_fd = 0; cur_fd <= maxfd; cur_fd++) {
-            if(FD_ISSET(cur_fd, &rset)) {
-                // Check if this socket descriptor is an active player
-                for(p = game.head; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        if (p ==  game.has_next_turn){
-                            //when play have turn input value
-                            char ca[MAX_BUF];
-                            int read = buf_read(ca, p);
-                            if (read == -2){
-                                // not have finished line just break wait for next turn to read
-                                break;
-                            }
-                            if (read == -1){
-                                //player have turn quit
-                                advance_turn(&game);
-                                char name[MAX_NAME];
-                                strcpy(name, p->name);
-                                printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                                remove_player(&(game.head), p->fd);
-                                char mesg[MAX_NAME + 9];
-                                sprintf(mesg, "goodbye %s\r\n", name);
-                                broadcast(&game, mesg);
-                                announce_turn(&game);
-                                break;
-                            }else if (read != 1 ||(*ca < 'a' || *ca > 'z')){
-                                // what we do when input is nor vailed
-                                char *mess = "invailed input\r\nyour guess\r\n";
-                                write(p->fd, mess, strlen(mess));
-                                break;
-                            }else{
-                                // when input is vailde
-                                int what_happen = guess_done(&game, *ca);
-                                if (what_happen == -1){
-                                    //when input is already have
-                                    char *mess = "guess already have\r\nyour guess?\r\n";
-                                    write(p->fd, mess, strlen(mess));
-                                }else if(what_happen == 0){
-                                    // wrong guss
-                                    char messg[MAX_BUF];
-                                    printf("%s's guess is %s\n", p->name, ca);
-                                    sprintf(messg, "%s's guess is %s\r\n", p->name, ca);
-                                    broadcast(&game, messg);
-                                    memset(messg, '\0', MAX_BUF);
-                                    sprintf(messg, "Letter %s is not in the word\r\n", ca);
-                                    printf("Letter %s is not in the word\n", ca);
-                                    write(p->fd, messg, strlen(messg));
-                                    broadcast(&game, status_message(messg, &game));
-                                    advance_turn(&game);
-                                    announce_turn(&game);
-                                }else if(what_happen == 1){
-                                    //this player win
-                                    announce_winner(&game, p);
-                                    init_game(&game,argv[1]);
-                                    advance_turn(&game);
-                                    printf("New Game\n");
-                                    broadcast(&game, "\r\n\r\n\r\n");
-                                    announce_turn(&game);
-                                }else if(what_happen == 3) {
-                                    // right guess
-                                    char messg[MAX_BUF];
-                                    sprintf(messg, "%s's guess is %s\r\n", p->name, ca);
-                                    broadcast(&game, messg);
-                                    broadcast(&game, status_message(messg, &game));
-                                    announce_turn(&game);
-                                }else{
-                                    // no guess left
-                                    char mess[MAX_BUF];
-                                    broadcast(&game, status_message(mess, &game));
-                                    memset(mess, '\0', MAX_BUF);
-                                    sprintf(mess, "haha, Game over!\r\nThe word is %s\r\nplay new game\r\n", game.word);
-                                    broadcast(&game, mess);
-                                    init_game(&game,argv[1]);
-                                    advance_turn(&game);
-                                    printf("New Game\n");
-                                    broadcast(&game, "\r\n\r\n\r\n");
-                                    announce_turn(&game);
-                                }
-                            }
-                        }else{
-                            //when player don't have turn input value
-                            char ca[MAX_BUF];
-                            int read = buf_read(ca, p);
-                            if (read == -2){
-                                //wait for next iteration to read
-                                break;
-                            }
-                            if(read == -1){
-                                // player don't have turn quit
-                                char name[MAX_NAME];
-                                strcpy(name, p->name);
-                                printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                                remove_player(&(game.head), p->fd);
-                                char mesg[MAX_NAME + 9];
-                                sprintf(mesg, "goodbye %s\r\n", name);
-                                broadcast(&game, mesg);
-                                announce_turn(&game);
-                            }else{
-                                // player input value 
-                                char *mess = "it's not your turn\r\n";
-                                write(p->fd, mess, strlen(mess));
-                                printf("%s tried to gues out of turn\n", p->name);
-                            } 
-                        }
-                        break;
-                    }
-                }
-        
-                // Check if any new players are entering their names
-                for(p = new_players; p != NULL; p = p->next) {
-                    if(cur_fd == p->fd) {
-                        char name[MAX_NAME];
-                        int name_len = buf_read(name, p);
-                        if (name_len == -1){
-                            printf("Disconnect from %s\n", inet_ntoa(q.sin_addr));
-                            remove_player(&new_players, p->fd);
-                            break;
-                        }
-                        if (name_len == -2){
-                            break;
-                        }
-                        if (name_len == 0){
-                            char *mess = "Name can not be empty\r\n What is your name?\r\n";
-                            write(p->fd, mess, strlen(mess));
-                            break;
-                        }
-                        if (name_len >= MAX_NAME){
-                            char *mess = "Name too long\r\n What is your name?\r\n";
-                            write(p->fd, mess, strlen(mess));
-                            break;
-                        }
-                        int compare;
-                        int count = 0;
-                        struct client *ap;
-                        for(ap = game.head; ap != NULL; ap = ap->next) {
-                            compare = strcmp(name, ap->name);
-                            if (compare == 0){
-                                char *mess = "Name already exsits\r\nWhat is your name?\r\n";
-                                write(p->fd, mess, strlen(mess));
-                                count = 1;
-                                break; 
-                            }
-                        }
-                        if (count == 1){
-                            break;
-                        }
-                        strcpy(p->name, name);
-                        if (p == new_players){
-                            new_players = p->next;
-                        }else{
-                            for(ap = game.head; ap != NULL; ap = ap->next) {
-                                if (ap->next == p){
-                                    ap->next = p->next;
-                                    break;
-                                }
-                            }
-                        }
-                        if(game.head == NULL){
-                            game.has_next_turn = p;
-                        }
-                        p->next = game.head;
-                        game.head = p;
-                        char mesg[MAX_BUF];
-                        sprintf(mesg,"%s have just joined\r\n", p->name);
-                        broadcast(&game, mesg);
-                        status_message(mesg, &game);
-                        write(p->fd, mesg, strlen(mesg));
-                        announce_turn(&game);
-                        break;
-                    }  
-                }
-            }
+    struct loop *loops = calloc(n_loops, sizeof(struct loop));
+    if (loops == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    struct lobby lobby = {PTHREAD_MUTEX_INITIALIZER};
+    unsigned int seed = time(NULL);
+    for (int i = 0; i < n_loops; i++) {
+        init_loop(&loops[i], server, &lobby, &dict, seed + i);
+    }
+    printf("Serving on %d event loops\n", n_loops);
+
+    // the main thread runs the first loop
+    pthread_t thread;
+    for (int i = 1; i < n_loops; i++) {
+        int err = pthread_create(&thread, NULL, run_loop, &loops[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: error %d\n", err);
+            exit(1);
         }
     }
+    run_loop(&loops[0]);
     return 0;
 }
-
-